@@ -1,14 +1,648 @@
+#pragma once
+
 #include <string>
 #include <vector>
 #include <memory>
 #include <functional>
 #include <unordered_map>
+#include <map>
 #include <stack>
 #include <tuple>
 #include <regex>
+#include <typeinfo>
+#include <algorithm>
+#include <exception>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <initializer_list>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TOKS_HAS_POSIX_IO 1
+#endif
+
+// io_uring is used by FileReader on Linux, define TOKS_NO_IO_URING to leave it out
+#if defined(__linux__) && !defined(TOKS_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define TOKS_HAS_IO_URING 1
+#endif
+
+// inotify wakes FileFollower up on Linux (it polls the file elsewhere)
+#if defined(__linux__) && __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#include <poll.h>
+#define TOKS_HAS_INOTIFY 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+// USDT probes (the sys/sdt.h convention of SystemTap and DTrace) in the lexer for bpftrace or perf,
+// built in when TOKS_USDT is defined (a probe is a nop until a tracer attaches to it):
+//   toks:tokenize__start(data, bytes)          toks:tokenize__end(bytes, tokens)
+//   toks:token__emit(offset, length, type)      toks:miss__storm(offset, misses)
+// miss__storm fires every TOKS_MISS_STORM parser attempts that failed in a row
+#if defined(TOKS_USDT)
+#if !__has_include(<sys/sdt.h>)
+#error "TOKS_USDT needs <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel)"
+#endif
+#include <sys/sdt.h>
+#define TOKS_HAS_USDT 1
+#define TOKS_PROBE2(name, a, b) DTRACE_PROBE2(toks, name, a, b)
+#define TOKS_PROBE3(name, a, b, c) DTRACE_PROBE3(toks, name, a, b, c)
+#ifndef TOKS_MISS_STORM
+#define TOKS_MISS_STORM 64
+#endif
+#else
+#define TOKS_PROBE2(name, a, b) ((void)0)
+#define TOKS_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+// the time stamp counter times the parsers in ParserProfile on x86 (steady_clock elsewhere)
+#if (defined(__x86_64__) || defined(__i386__)) && __has_include(<x86intrin.h>)
+#include <x86intrin.h>
+#define TOKS_HAS_RDTSC 1
+#endif
 
 namespace hl {
 
+class ThreadPool;
+
+
+namespace detail {
+
+// index of the lowest set bit, x must not be 0
+inline unsigned ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctzll(x));
+#else
+    unsigned n = 0;
+    for (; (x & 1) == 0; x >>= 1, ++n);
+    return n;
+#endif
+}
+
+// index of the highest set bit, x must not be 0
+inline unsigned clz64_index(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - static_cast<unsigned>(__builtin_clzll(x));
+#else
+    unsigned n = 0;
+    for (; x >>= 1; ++n);
+    return n;
+#endif
+}
+
+inline unsigned popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_popcountll(x));
+#else
+    unsigned n = 0;
+    for (; x; x &= x - 1, ++n);
+    return n;
+#endif
+}
+
+// bit i of the result is the xor of the bits [0, i] of x
+inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// returns the mask of the bytes of a 64 bytes block that are equal to c
+inline uint64_t match_byte(const unsigned char *block, unsigned char c) {
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(c));
+    uint64_t mask = 0;
+    for (unsigned i = 0; i < 64; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+        mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, needle)))) << i;
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (unsigned i = 0; i < 64; ++i) {
+        mask |= static_cast<uint64_t>(block[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+// A set of bytes that can be matched against 64 bytes at a time
+// It uses a universal nibble lookup when SSSE3 is available, one vector
+// comparison per byte for small sets with SSE2, and a byte table otherwise
+class ByteSet {
+private:
+    uint8_t m_table[256] = {};
+    unsigned char m_bytes[4] = {};
+    size_t m_count = 0;
+#if defined(__SSSE3__)
+    alignas(16) uint8_t m_low_half[16] = {}; // bit h set if (h << 4 | low nibble) is in the set, for h < 8
+    alignas(16) uint8_t m_high_half[16] = {}; // same for h >= 8
+#endif
+
+public:
+    ByteSet() = default;
+
+    explicit ByteSet(const std::bitset<256>& bytes) {
+        for (unsigned c = 0; c < 256; ++c) {
+            if (!bytes[c]) {
+                continue;
+            }
+            m_table[c] = 1;
+            if (m_count < 4) {
+                m_bytes[m_count] = static_cast<unsigned char>(c);
+            }
+            ++m_count;
+#if defined(__SSSE3__)
+            auto& table = c < 128 ? m_low_half : m_high_half;
+            table[c & 0x0f] |= static_cast<uint8_t>(1u << ((c >> 4) & 7));
+#endif
+        }
+    }
+
+    bool contains(unsigned char c) const {
+        return m_table[c] != 0;
+    }
+
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    // returns the mask of the bytes of a 64 bytes block that are in the set
+    uint64_t match(const unsigned char *block) const {
+        if (m_count == 0) {
+            return 0;
+        }
+#if defined(__SSE2__)
+        if (m_count <= 4) {
+            uint64_t mask = 0;
+            for (size_t i = 0; i < m_count; ++i) {
+                mask |= match_byte(block, m_bytes[i]);
+            }
+            return mask;
+        }
+#endif
+#if defined(__SSSE3__)
+        const __m128i low_table = _mm_load_si128(reinterpret_cast<const __m128i *>(m_low_half));
+        const __m128i high_table = _mm_load_si128(reinterpret_cast<const __m128i *>(m_high_half));
+        const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        uint64_t mask = 0;
+        for (unsigned i = 0; i < 64; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+            __m128i low = _mm_and_si128(x, nibble);
+            __m128i high = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+            __m128i upper = _mm_cmplt_epi8(x, _mm_setzero_si128()); // bytes >= 0x80
+            __m128i rows = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(low_table, low)),
+                                        _mm_and_si128(upper, _mm_shuffle_epi8(high_table, low)));
+            __m128i bit = _mm_shuffle_epi8(bits, high);
+            __m128i hit = _mm_cmpeq_epi8(_mm_and_si128(rows, bit), bit);
+            mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(hit))) << i;
+        }
+        return mask;
+#else
+        uint64_t mask = 0;
+        for (unsigned i = 0; i < 64; ++i) {
+            mask |= static_cast<uint64_t>(m_table[block[i]]) << i;
+        }
+        return mask;
+#endif
+    }
+};
+
+// returns a 64 bits hash of the bytes (not a cryptographic one, for the caches)
+inline uint64_t hash_bytes(const char *data, size_t size, uint64_t seed = 0) {
+    auto mix = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    };
+    uint64_t h = seed ^ (static_cast<uint64_t>(size) * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h ^= word * 0x87c37b91114253d5ULL;
+        h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+    }
+    uint64_t tail = 0;
+    if (i < size) {
+        memcpy(&tail, data + i, size - i);
+    }
+    return mix(h ^ tail);
+}
+
+} // namespace detail
+
+// The places of the library that allocate, for AllocationStats
+enum class AllocationSource : uint8_t {
+    Other, // the dispatch table, the structural index, the memo of a partial stream...
+    StreamCopy, // the copies (and the normalization) of the tokenized string
+    TokenValues, // the values of the tokens, and the strings the parsers make for them
+    CallbackResults, // the tokens returned by the parsers (make_parser_callback_result)
+    TokenVector, // the growth of the vector of tokens
+    Regex, // the regex searches
+    Count
+};
+
+// The allocations of a thread while an AllocationTracker is alive, by source
+// The library marks its sources when built with TOKS_TRACK_ALLOCATIONS defined, and the allocations
+// are counted by the replaced operator new of TOKS_ALLOCATION_HOOK (to expand in a single .cpp file):
+//
+//   #define TOKS_TRACK_ALLOCATIONS
+//   #include "Toks.hpp"
+//   TOKS_ALLOCATION_HOOK
+//
+//   hl::AllocationStats stats;
+//   {
+//       hl::AllocationTracker tracker(stats);
+//       tokenizer.tokenize(code);
+//   }
+struct AllocationStats {
+    uint64_t count[static_cast<size_t>(AllocationSource::Count)] = {};
+    uint64_t bytes[static_cast<size_t>(AllocationSource::Count)] = {};
+
+    static const char *name(AllocationSource source) {
+        static const char *const names[] = { "other", "stream_copy", "token_values", "callback_results",
+                                             "token_vector", "regex" };
+        return names[static_cast<size_t>(source)];
+    }
+
+    uint64_t total_count() const {
+        uint64_t total = 0;
+        for (auto c : count) {
+            total += c;
+        }
+        return total;
+    }
+
+    uint64_t total_bytes() const {
+        uint64_t total = 0;
+        for (auto b : bytes) {
+            total += b;
+        }
+        return total;
+    }
+
+    // returns a line per source
+    std::string report() const {
+        std::string out;
+        char line[128];
+        for (size_t i = 0; i < static_cast<size_t>(AllocationSource::Count); ++i) {
+            snprintf(line, sizeof(line), "%-18s %12llu allocations %16llu bytes\n",
+                     name(static_cast<AllocationSource>(i)), static_cast<unsigned long long>(count[i]),
+                     static_cast<unsigned long long>(bytes[i]));
+            out += line;
+        }
+        return out;
+    }
+};
+
+namespace detail {
+
+struct AllocationState {
+    AllocationStats* stats = nullptr;
+    AllocationSource source = AllocationSource::Other;
+};
+
+inline AllocationState& allocation_state() {
+    static thread_local AllocationState state;
+    return state;
+}
+
+// counts an allocation of the calling thread (called by TOKS_ALLOCATION_HOOK)
+inline void count_allocation(size_t size) {
+    auto& state = allocation_state();
+    if (state.stats != nullptr) {
+        ++state.stats->count[static_cast<size_t>(state.source)];
+        state.stats->bytes[static_cast<size_t>(state.source)] += size;
+    }
+}
+
+// the allocations of the scope come from the source (see TOKS_ALLOCATION_SCOPE)
+class AllocationScope {
+private:
+    AllocationSource m_previous;
+
+public:
+    explicit AllocationScope(AllocationSource source)
+        : m_previous(allocation_state().source)
+    {
+        allocation_state().source = source;
+    }
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    ~AllocationScope() {
+        allocation_state().source = m_previous;
+    }
+};
+
+} // namespace detail
+
+// Counts the allocations of the calling thread into the stats while alive
+class AllocationTracker {
+private:
+    AllocationStats* m_previous;
+
+public:
+    explicit AllocationTracker(AllocationStats& stats)
+        : m_previous(detail::allocation_state().stats)
+    {
+        detail::allocation_state().stats = &stats;
+    }
+
+    AllocationTracker(const AllocationTracker&) = delete;
+    AllocationTracker& operator=(const AllocationTracker&) = delete;
+
+    ~AllocationTracker() {
+        detail::allocation_state().stats = m_previous;
+    }
+};
+
+#if defined(TOKS_TRACK_ALLOCATIONS)
+#define TOKS_ALLOCATION_SCOPE(source) \
+    ::hl::detail::AllocationScope toks_allocation_scope(::hl::AllocationSource::source)
+#else
+#define TOKS_ALLOCATION_SCOPE(source) ((void)0)
+#endif
+
+// (the replaced delete is not inlined, where GCC would see a free of a pointer from new)
+#if defined(__GNUC__) || defined(__clang__)
+#define TOKS_NOINLINE __attribute__((noinline))
+#else
+#define TOKS_NOINLINE
+#endif
+
+// replaces the global operator new and delete to count the allocations (see AllocationStats)
+#define TOKS_ALLOCATION_HOOK \
+    void *operator new(std::size_t size) { \
+        ::hl::detail::count_allocation(size); \
+        if (void *p = std::malloc(size == 0 ? 1 : size)) { \
+            return p; \
+        } \
+        throw std::bad_alloc(); \
+    } \
+    TOKS_NOINLINE void operator delete(void *p) noexcept { \
+        std::free(p); \
+    } \
+    TOKS_NOINLINE void operator delete(void *p, std::size_t) noexcept { \
+        std::free(p); \
+    }
+
+// A bitmask index of the structural bytes of a string (in the style of simdjson)
+// The string is scanned 64 bytes at a time, and every block stores one bit per byte for:
+// - whitespace and newlines
+// - bytes that can start at least one parser of the grammar
+// - delimiter bytes (the first byte of the end string of a TokenBeginEndPair)
+// - quoted regions, computed with a prefix xor over the bytes of the symmetric
+//   single byte pairs (like "..."), this is a hint as it does not know about comments
+//
+// Once attached to a FileTokenStream (see FileTokenStream::set_index) skipping
+// whitespace, moving forward, measuring words and finding delimiters become
+// bit scans instead of byte per byte loops.
+class StructuralIndex {
+public:
+    struct Block {
+        uint64_t whitespace = 0;
+        uint64_t newline = 0;
+        uint64_t start = 0;
+        uint64_t delimiter = 0;
+        uint64_t quoted = 0;
+    };
+
+    // the bytes the index is built for
+    struct ByteClasses {
+        std::bitset<256> start;
+        std::bitset<256> delimiter;
+        std::bitset<256> quote;
+    };
+
+private:
+    std::vector<Block> m_blocks;
+    size_t m_size = 0;
+    std::bitset<256> m_delimiter_bytes;
+
+    // builds the blocks [first, last) assuming the region before them is not quoted
+    // returns whether the last block ends inside a quoted region
+    bool build_blocks(const std::string& str, const ByteClasses& classes, size_t first, size_t last) {
+        std::bitset<256> newline_bytes, whitespace_bytes;
+        newline_bytes.set('\n').set('\r');
+        whitespace_bytes.set(' ').set('\t').set('\n').set('\r');
+
+        const detail::ByteSet newline(newline_bytes);
+        const detail::ByteSet whitespace(whitespace_bytes);
+        const detail::ByteSet start(classes.start);
+        const detail::ByteSet delimiter(classes.delimiter);
+        const detail::ByteSet quote(classes.quote);
+        uint64_t inside = 0;
+
+        for (size_t b = first; b < last; ++b) {
+            const size_t offset = b * 64;
+            const unsigned char *block = reinterpret_cast<const unsigned char *>(str.data()) + offset;
+            unsigned char tail[64];
+
+            if (offset + 64 > str.size()) {
+                // pad the last block, the padding bits are masked below
+                std::memset(tail, 0, sizeof(tail));
+                std::memcpy(tail, block, str.size() - offset);
+                block = tail;
+            }
+            const uint64_t valid = offset + 64 > str.size() ? (uint64_t(1) << (str.size() - offset)) - 1 : ~uint64_t(0);
+            const uint64_t quotes = quote.match(block) & valid;
+
+            auto& out = m_blocks[b];
+            out.whitespace = whitespace.match(block) & valid;
+            out.newline = newline.match(block) & valid;
+            out.start = start.match(block) & valid;
+            out.delimiter = delimiter.match(block) & valid;
+            out.quoted = (detail::prefix_xor(quotes) ^ inside) & valid;
+            inside = static_cast<uint64_t>(static_cast<int64_t>(detail::prefix_xor(quotes) ^ inside) >> 63);
+        }
+        return inside != 0;
+    }
+
+    // returns the position of the first byte at or after pos whose bit is set in the given field
+    template<typename Field>
+    size_t find_next(size_t pos, Field field) const {
+        if (pos >= m_size) {
+            return m_size;
+        }
+        size_t b = pos / 64;
+        uint64_t bits = field(m_blocks[b]) & (~uint64_t(0) << (pos % 64));
+        while (bits == 0) {
+            if (++b == m_blocks.size()) {
+                return m_size;
+            }
+            bits = field(m_blocks[b]);
+        }
+        return std::min(m_size, b * 64 + detail::ctz64(bits));
+    }
+
+public:
+    StructuralIndex() = default;
+
+    // index the given string, the blocks are built on the pool when one is given
+    StructuralIndex(const std::string& str, const ByteClasses& classes, ThreadPool* pool = nullptr) {
+        build(str, classes, pool);
+    }
+
+    // index the given string, reusing the memory of the previous index
+    void build(const std::string& str, const ByteClasses& classes, ThreadPool* pool = nullptr);
+
+    // returns the size of the indexed string
+    size_t size() const {
+        return m_size;
+    }
+
+    // returns the blocks of the index
+    const std::vector<Block>& blocks() const {
+        return m_blocks;
+    }
+
+    bool is_whitespace(size_t pos) const {
+        return (m_blocks[pos / 64].whitespace >> (pos % 64)) & 1;
+    }
+
+    // returns true if at least one parser can start at this position
+    bool is_start(size_t pos) const {
+        return (m_blocks[pos / 64].start >> (pos % 64)) & 1;
+    }
+
+    // returns true if the position is inside a symmetric quoted region (a hint, see above)
+    bool is_quoted(size_t pos) const {
+        return (m_blocks[pos / 64].quoted >> (pos % 64)) & 1;
+    }
+
+    // returns the first position at or after pos that is not whitespace (or the size)
+    size_t next_non_whitespace(size_t pos) const {
+        return find_next(pos, [](const Block& block) { return ~block.whitespace; });
+    }
+
+    // returns the first whitespace at or after pos (or the size)
+    size_t next_whitespace(size_t pos) const {
+        return find_next(pos, [](const Block& block) { return block.whitespace; });
+    }
+
+    // returns the first position at or after pos that is whitespace or can start a parser (or the size)
+    size_t next_stop(size_t pos) const {
+        return find_next(pos, [](const Block& block) { return block.whitespace | block.start; });
+    }
+
+    // returns true if the byte is indexed as a delimiter
+    bool is_delimiter_byte(unsigned char c) const {
+        return m_delimiter_bytes[c];
+    }
+
+    // returns the first delimiter byte at or after pos (or the size)
+    size_t next_delimiter(size_t pos) const {
+        return find_next(pos, [](const Block& block) { return block.delimiter; });
+    }
+
+    // returns the amount of newlines in [from, to), and the position of the last one in last
+    size_t count_newlines(size_t from, size_t to, size_t& last) const {
+        size_t count = 0;
+        to = std::min(to, m_size);
+        while (from < to) {
+            const size_t b = from / 64;
+            const size_t block_end = std::min(to, b * 64 + 64);
+            uint64_t bits = m_blocks[b].newline >> (from % 64);
+            if (block_end - from < 64) {
+                bits &= (uint64_t(1) << (block_end - from)) - 1;
+            }
+            if (bits != 0) {
+                count += detail::popcount64(bits);
+                last = from + detail::clz64_index(bits);
+            }
+            from = block_end;
+        }
+        return count;
+    }
+};
+
+namespace detail {
+
+// Remembers how far the failed scans of a partial stream went, by where they started and what
+// they looked for, so that they continue from there once more bytes are appended
+// The positions are offsets in the whole input.
+class ScanMemo {
+private:
+    struct Entry {
+        size_t from;
+        const void* key;
+        size_t until;
+    };
+    std::vector<Entry> m_entries;
+
+public:
+    // returns where the scan that started at from may continue
+    size_t resume(size_t from, const void* key) const {
+        for (const Entry& entry : m_entries) {
+            if (entry.from == from && entry.key == key) {
+                return entry.until;
+            }
+        }
+        return from;
+    }
+
+    void store(size_t from, const void* key, size_t until) {
+        for (Entry& entry : m_entries) {
+            if (entry.from == from && entry.key == key) {
+                entry.until = until;
+                return;
+            }
+        }
+        m_entries.push_back(Entry{from, key, until});
+    }
+
+    // forgets the scans that started before pos
+    void drop_before(size_t pos) {
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+                                       [pos](const Entry& entry) { return entry.from < pos; }),
+                        m_entries.end());
+    }
+
+    void clear() {
+        m_entries.clear();
+    }
+};
+
+} // namespace detail
 
 // A simple token stream that can be used to tokenize a string
 // It is not meant to be used for large files, but rather for small
@@ -16,48 +650,216 @@ namespace hl {
 // It is used to easily tokenize a string, and it is not meant to be
 // used for anything else.
 //
-// It will replace all \r\n with \n, and all \r with \n
+// It will replace all \r\n with \n, and drop any other \r
 // It will also keep track of the line and column of the current position
 // in the string.
 //
 // It also provides a simple way to skip whitespace, and get a word
 // (a string of characters that are not whitespace)
 //
+// A stream either owns a normalized copy of its string, or borrows an
+// already normalized string (see FileTokenStream::borrow) so that several
+// streams can read the same buffer without copying it.
+//
+// A partial stream (see FileTokenStream::set_partial) reads the beginning of an
+// input whose remaining bytes are not known yet: it remembers whether anything
+// looked at the end of its string, so that the lexer can tell the tokens that
+// are certain from the ones that may still change.
+//
 class FileTokenStream {
 private:
-    std::string m_string;
+    std::string m_storage; // the owned copy of the string (unused when borrowing)
+    const std::string* m_string = &m_storage; // the string that is being tokenized
     size_t m_pos = 0;
     size_t m_line = 0;
     size_t m_column = 0;
+    const StructuralIndex* m_index = nullptr; // the optional structural index of the string
+
+    bool m_partial = false; // more bytes may follow the end of the string
+    mutable size_t m_reach = 0; // one past the last byte looked at (size() + 1 once the end was looked at)
+    size_t m_regex_lookahead = 1; // how far past their match the regexes are assumed to look
+    detail::ScanMemo* m_memo = nullptr; // the failed scans of a partial stream
+    size_t m_base = 0; // the offset of the string in the whole input (for the memo)
+    std::vector<uint32_t> m_modes; // the stack of the lexer modes (empty in the default mode)
+    mutable size_t m_regex_searches = 0; // the regex searches so far (see ParserProfile)
 
     std::stack<std::tuple<size_t, size_t, size_t>> m_stack_states;
 
+    FileTokenStream() = default;
+
 public:
     // Create a token stream from a string
-    FileTokenStream(const std::string& string)
-        : m_string(string)
+    FileTokenStream(const std::string& string) {
+        TOKS_ALLOCATION_SCOPE(StreamCopy);
+        m_storage = string;
+        normalize(m_storage);
+    }
+
+    // Create a token stream from a string, taking ownership of it
+    FileTokenStream(std::string&& string)
+        : m_storage(std::move(string))
     {
-        // replace all \r\n with \n
-        for (size_t i = 0; i < m_string.size(); ++i) {
-            if (m_string[i] == '\r' && m_string[i + 1] == '\n') {
-                m_string.erase(i, 1);
-            }
+        normalize(m_storage);
+    }
+
+    // Create a token stream that reads the given string without copying it
+    // The string must already be normalized (see is_normalized) and must outlive the stream
+    static FileTokenStream borrow(const std::string& normalized) {
+        FileTokenStream stream;
+        stream.m_string = &normalized;
+        return stream;
+    }
+
+    FileTokenStream(const FileTokenStream& other) {
+        *this = other;
+    }
+
+    FileTokenStream(FileTokenStream&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    FileTokenStream& operator=(const FileTokenStream& other) {
+        if (this != &other) {
+            TOKS_ALLOCATION_SCOPE(StreamCopy);
+            m_storage = other.m_storage;
+            m_string = other.borrowed() ? other.m_string : &m_storage;
+            m_pos = other.m_pos;
+            m_line = other.m_line;
+            m_column = other.m_column;
+            m_index = other.m_index;
+            m_partial = other.m_partial;
+            m_reach = other.m_reach;
+            m_regex_lookahead = other.m_regex_lookahead;
+            m_memo = other.m_memo;
+            m_base = other.m_base;
+            m_modes = other.m_modes;
+            m_regex_searches = other.m_regex_searches;
+            m_stack_states = other.m_stack_states;
         }
-        // replace all \r with \n
-        for (size_t i = 0; i < m_string.size(); ++i) {
-            if (m_string[i] == '\r') {
-                m_string.erase(i, 1);
-            }
+        return *this;
+    }
+
+    FileTokenStream& operator=(FileTokenStream&& other) noexcept {
+        if (this != &other) {
+            m_storage = std::move(other.m_storage);
+            m_string = other.borrowed() ? other.m_string : &m_storage;
+            m_pos = other.m_pos;
+            m_line = other.m_line;
+            m_column = other.m_column;
+            m_index = other.m_index;
+            m_partial = other.m_partial;
+            m_reach = other.m_reach;
+            m_regex_lookahead = other.m_regex_lookahead;
+            m_memo = other.m_memo;
+            m_base = other.m_base;
+            m_modes = std::move(other.m_modes);
+            m_regex_searches = other.m_regex_searches;
+            m_stack_states = std::move(other.m_stack_states);
+        }
+        return *this;
+    }
+
+    // replace all \r\n with \n, and drop any other \r (in a single pass)
+    // (every \r is dropped, "a\r\rb" gives "ab": the erase loop this replaced kept the second of two \r)
+    static void normalize(std::string& string) {
+        auto end = std::remove(string.begin(), string.end(), '\r');
+        string.erase(end, string.end());
+    }
+
+    // returns true if the string does not need to be normalized
+    static bool is_normalized(const std::string& string) {
+        return string.find('\r') == std::string::npos;
+    }
+
+    // returns true if the stream reads a string it does not own
+    bool borrowed() const {
+        return m_string != &m_storage;
+    }
+
+    // attach a structural index of the string (or detach it with nullptr)
+    // The index must have been built from the string of the stream and must outlive it
+    void set_index(const StructuralIndex* index) {
+        m_index = index;
+    }
+
+    // returns the structural index of the string, if any
+    const StructuralIndex* index() const {
+        return m_index;
+    }
+
+    // marks the string as the beginning of a longer input (or as a whole input again with false)
+    // A regex match is only certain if it ends at least regex_lookahead bytes before the end of the string.
+    // The memo (optional) lets the failed scans continue where they stopped once bytes are appended,
+    // base is the offset of the string in the whole input.
+    void set_partial(bool partial, size_t regex_lookahead = 1, detail::ScanMemo* memo = nullptr, size_t base = 0) {
+        m_partial = partial;
+        m_regex_lookahead = regex_lookahead;
+        m_memo = partial ? memo : nullptr;
+        m_base = base;
+        m_reach = 0;
+    }
+
+    // returns true if more bytes may follow the end of the string
+    bool partial() const {
+        return m_partial;
+    }
+
+    // returns one past the last byte looked at since the last clear_reach
+    // (size() + 1 if the end of the string was looked at)
+    size_t reach() const {
+        return m_reach;
+    }
+
+    void clear_reach() {
+        m_reach = 0;
+    }
+
+    // records that the bytes before end were looked at
+    // (the parsers that read str() or c_str() directly should call it)
+    void looked_at(size_t end) const {
+        if (end > m_reach) {
+            m_reach = end;
+        }
+    }
+
+    // returns true if the end of the string was looked at since the last clear_reach
+    // (a result that depends on it may change once more bytes follow)
+    bool touched_end() const {
+        return m_reach > m_string->size();
+    }
+
+    // returns the current lexer mode (0 is the default mode, see Tokenizer::select_mode)
+    uint32_t mode() const {
+        return m_modes.empty() ? 0 : m_modes.back();
+    }
+
+    // returns the stack of the lexer modes
+    const std::vector<uint32_t>& modes() const {
+        return m_modes;
+    }
+
+    void set_modes(const std::vector<uint32_t>& modes) {
+        m_modes = modes;
+    }
+
+    void push_mode(uint32_t mode) {
+        m_modes.push_back(mode);
+    }
+
+    // goes back to the previous mode (the default mode stays)
+    void pop_mode() {
+        if (!m_modes.empty()) {
+            m_modes.pop_back();
         }
     }
 
     // returns the string that is being tokenized
     const std::string& str() const {
-        return m_string;
+        return *m_string;
     }
 
     const char* c_str() const {
-        return m_string.c_str();
+        return m_string->c_str();
     }
 
     // returns the current position in the string
@@ -77,17 +879,19 @@ public:
 
     // returns the size of the string
     size_t size() const {
-        return m_string.size();
+        return m_string->size();
     }
 
     // returns true if the end of the string has been reached
     bool eof() const {
-        return m_pos >= m_string.size();
+        looked_at(m_pos + 1);
+        return m_pos >= m_string->size();
     }
 
     // returns the character at the current position
     char peek() const {
-        return m_string[m_pos];
+        looked_at(m_pos + 1);
+        return (*m_string)[m_pos];
     }
 
     bool is_linebreak() const {
@@ -100,6 +904,21 @@ public:
 
     // returns the character at the current position, and advances the position
     void next(size_t n=1) {
+        // short moves are cheaper byte per byte than with the index
+        if (m_index != nullptr && n > 16) {
+            const size_t target = std::min(size(), m_pos + std::min(n, size()));
+            size_t last = 0;
+            const size_t newlines = m_index->count_newlines(m_pos, target, last);
+            looked_at(target);
+            if (newlines != 0) {
+                m_line += newlines;
+                m_column = target - last - 1;
+            } else {
+                m_column += target - m_pos;
+            }
+            m_pos = target;
+            return;
+        }
         for (size_t i = 0; i < n && !eof(); ++i) {
             if (is_linebreak()) {
                 ++m_line;
@@ -111,30 +930,140 @@ public:
         }
     }
 
+    // moves to the given position without updating the line and the column
+    void seek(size_t pos) {
+        m_pos = pos;
+    }
+
+    // moves to the given position, the caller provides the line and column of that position
+    void seek(size_t pos, size_t line, size_t column) {
+        m_pos = pos;
+        m_line = line;
+        m_column = column;
+    }
+
     // skips all whitespace characters
     void skip_whitespace() {
+        // most runs of whitespace are a single character
+        for (size_t i = 0; i < 2; ++i) {
+            if (eof() || !is_whitespace()) {
+                return;
+            }
+            next();
+        }
+        if (m_index != nullptr) {
+            const size_t end = m_index->next_non_whitespace(m_pos);
+            looked_at(end + 1);
+            next(end - m_pos);
+            return;
+        }
         for (; !eof() && is_whitespace(); next());
     }
 
+    // returns the amount of characters before the next whitespace (or the end of the string)
+    size_t word_length() const {
+        // a partial stream continues the scan where it stopped the last time
+        if (m_memo != nullptr) {
+            // (the words are remembered without a key)
+            size_t end = m_memo->resume(m_base + m_pos, nullptr) - m_base;
+            for (; end < size() && !is_whitespace_char((*m_string)[end]); ++end);
+            looked_at(end + 1);
+            if (end >= size()) {
+                m_memo->store(m_base + m_pos, nullptr, m_base + size());
+            }
+            return end - std::min(m_pos, size());
+        }
+        // most words are short, the index is only used past the first 16 characters
+        size_t end = m_pos;
+        for (; end < size() && end < m_pos + 16 && !is_whitespace_char((*m_string)[end]); ++end);
+        if (m_index != nullptr && end == m_pos + 16) {
+            end = m_index->next_whitespace(end);
+        }
+        for (; end < size() && !is_whitespace_char((*m_string)[end]); ++end);
+        looked_at(end + 1);
+        return end - std::min(m_pos, size());
+    }
+
+    static bool is_whitespace_char(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
     // checks if the current position starts with the given string
     bool starts_with(const std::string& str) const {
-        return m_string.compare(m_pos, str.size(), str) == 0;
+        if (str.size() > size() - std::min(m_pos, size())) {
+            // the string would continue past the end, it may match once more bytes follow
+            const bool prefix = m_pos <= size() && m_string->compare(m_pos, std::string::npos, str, 0, size() - m_pos) == 0;
+            looked_at(prefix ? size() + 1 : size());
+            return false;
+        }
+        looked_at(m_pos + str.size());
+        return m_string->compare(m_pos, str.size(), str) == 0;
     }
 
     // finds the first occurence of the given string, starting at the current position
+    // returns its offset from the current position, or std::string::npos if it was not found
     size_t find(const std::string& str, size_t pos=0) const {
+        if (m_memo != nullptr) {
+            // a partial stream continues the search where it stopped the last time
+            const size_t from = m_pos + pos;
+            const size_t start = m_memo->resume(m_base + from, &str) - m_base;
+            const size_t at = m_string->find(str, start);
+            if (at != std::string::npos) {
+                looked_at(at + str.size());
+                return at - m_pos;
+            }
+            looked_at(size() + 1);
+            // an occurence may start in the last str.size() - 1 bytes
+            m_memo->store(m_base + from, &str, m_base + std::max(from, size() + 1 - std::min(size() + 1, str.size())));
+            return std::string::npos;
+        }
+        // a single indexed delimiter byte is found by scanning the delimiter bits
+        if (m_index != nullptr && str.size() == 1 && m_index->is_delimiter_byte(str[0])) {
+            for (size_t at = m_index->next_delimiter(m_pos + pos); at < size(); at = m_index->next_delimiter(at + 1)) {
+                if ((*m_string)[at] == str[0]) {
+                    looked_at(at + 1);
+                    return at - m_pos;
+                }
+            }
+            looked_at(size() + 1);
+            return std::string::npos;
+        }
         // start at m_pos, and find the first occurence of str
-        return m_string.find(str, m_pos + pos) - m_pos;
+        const size_t at = m_string->find(str, m_pos + pos);
+        if (at == std::string::npos) {
+            looked_at(size() + 1);
+            return std::string::npos;
+        }
+        looked_at(at + str.size());
+        return at - m_pos;
     }
 
     // Substring from the current position
     std::string substr(size_t pos, size_t len) const {
-        return m_string.substr(m_pos + pos, len);
+        looked_at(len > size() - std::min(m_pos + pos, size()) ? size() + 1 : m_pos + pos + len);
+        return m_string->substr(m_pos + pos, len);
     }
 
     // Checks if the given regex matches the current position
-    bool regex_match(const std::regex& regex, std::smatch& match) const {
-        return std::regex_search(m_string.cbegin() + m_pos, m_string.cend(), match, regex);
+    // (anchored, only a match at the current position is looked for instead of searching the rest of the string)
+    bool regex_match(const std::regex& regex, std::smatch& match, bool anchored = false) const {
+        TOKS_ALLOCATION_SCOPE(Regex);
+        ++m_regex_searches;
+        const bool found = std::regex_search(m_string->cbegin() + m_pos, m_string->cend(), match, regex,
+                                             anchored ? std::regex_constants::match_continuous
+                                                      : std::regex_constants::match_default);
+        // the search went to the end, or it is assumed to have looked regex_lookahead bytes past the match
+        if (!found) {
+            looked_at(size() + 1);
+        } else {
+            looked_at(std::min(size() + 1, m_pos + static_cast<size_t>(match.position() + match.length()) + m_regex_lookahead));
+        }
+        return found;
+    }
+
+    // returns the amount of regex searches (see regex_match) done on the stream
+    size_t regex_searches() const {
+        return m_regex_searches;
     }
 
     // Stores the current position, line and column (so that it can be restored later)
@@ -160,23 +1089,128 @@ struct TokenInfo {
     const char *token_type; // token_type is the type of the token
     std::string value; // the value of the token
     size_t line, column; // the line and column of the token
+    size_t offset = 0; // the offset of the token in the normalized string (set by the tokenizer)
 
     TokenInfo(const char *token_type, const std::string& keyword, const size_t &line, const size_t &column)
         : token_type(token_type), value(keyword), line(line), column(column)
     {}
 };
 
-class TokenParser;
-class Tokenizer;
+// A token stored without its strings, for the token caches and transports: the type is an index in
+// a table of type names and the value is a range of the source, or of a separate buffer of values
+// when it is not found in the source (the values made by a parser, like the ones of a combinator)
+struct PackedToken {
+    static constexpr uint32_t out_of_line = 0x80000000u; // the bit of type set when the value is not in the source
 
-// Represents how a specific token will be parsed from a string
-using ParserCallbackResult = std::unique_ptr<TokenInfo>;
-using ParserCallback = std::function<ParserCallbackResult(FileTokenStream&, TokenParser&)>;
+    uint64_t offset; // see TokenInfo::offset
+    uint64_t value; // the offset of the value in the source, or in the values when out of line
+    uint32_t length; // the length of the value
+    uint32_t type;
+
+    uint32_t type_id() const {
+        return type & ~out_of_line;
+    }
+
+    bool value_out_of_line() const {
+        return (type & out_of_line) != 0;
+    }
+};
+
+// Finds the tokens of a vector by offset or by line, without going through the vector
+//
+// Holds the offsets where the tokens start and end (sorted, as the tokenizer makes them) and the first token
+// of every line. Built by Tokenizer::tokenize(str, TokenIndex&) while lexing, where the end of every token
+// is known. The indices it returns are the ones of the vector, it is to be built again when the tokens change.
+class TokenIndex {
+private:
+    std::vector<size_t> m_begins;
+    std::vector<size_t> m_ends;
+    std::vector<size_t> m_line_first; // the first token starting on the line, or after it for a line without
+
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    TokenIndex() = default;
+
+    // adds the next token, which ends at end (the tokens come in the order of their offsets)
+    // (the end is the one the lexer recorded: the value of a token may be shorter than its bytes,
+    // like the one of a begin end pair, and a pair may end with whitespace)
+    void add(const TokenInfo& token, size_t end) {
+        const size_t index = m_begins.size();
+        m_begins.push_back(token.offset);
+        m_ends.push_back(end);
+        while (m_line_first.size() <= token.line) {
+            m_line_first.push_back(index);
+        }
+    }
+
+    void reserve(size_t tokens) {
+        m_begins.reserve(tokens);
+        m_ends.reserve(tokens);
+    }
+
+    void clear() {
+        m_begins.clear();
+        m_ends.clear();
+        m_line_first.clear();
+    }
+
+    size_t size() const {
+        return m_begins.size();
+    }
+
+    // the lines up to the one of the last token
+    size_t line_count() const {
+        return m_line_first.size();
+    }
+
+    // returns the token covering the byte at the offset (of the normalized string), or npos in between tokens (O(log n))
+    size_t token_at(size_t offset) const {
+        const size_t next = first_at_or_after(offset + 1);
+        if (next == 0 || offset >= m_ends[next - 1]) {
+            return npos;
+        }
+        return next - 1;
+    }
+
+    // returns the first token starting at the offset or after it, or size() (O(log n))
+    size_t first_at_or_after(size_t offset) const {
+        return static_cast<size_t>(std::lower_bound(m_begins.begin(), m_begins.end(), offset) - m_begins.begin());
+    }
+
+    // returns the range [first, last) of the tokens starting on the line (O(1))
+    std::pair<size_t, size_t> tokens_on_line(size_t line) const {
+        const size_t first = line < m_line_first.size() ? m_line_first[line] : size();
+        const size_t last = line + 1 < m_line_first.size() ? m_line_first[line + 1] : size();
+        return { first, last };
+    }
+};
+
+class TokenParser;
+class Tokenizer;
+class TokenCache;
+class SpillingTokens;
+class SharedTokenRing;
+
+// Represents how a specific token will be parsed from a string
+using ParserCallbackResult = std::unique_ptr<TokenInfo>;
+using ParserCallback = std::function<ParserCallbackResult(FileTokenStream&, TokenParser&)>;
 
 
 static ParserCallbackResult make_parser_callback_result(const char *token_type, const std::string& keyword, const size_t &line, const size_t &column)
 {
+#if defined(TOKS_TRACK_ALLOCATIONS)
+    ParserCallbackResult token;
+    {
+        TOKS_ALLOCATION_SCOPE(CallbackResults);
+        token = std::make_unique<TokenInfo>(token_type, std::string(), line, column);
+    }
+    TOKS_ALLOCATION_SCOPE(TokenValues);
+    token->value = keyword;
+    return token;
+#else
     return std::make_unique<TokenInfo>(token_type, keyword, line, column);
+#endif
 }
 
 // Base class for all token parsers
@@ -184,6 +1218,10 @@ class TokenParser {
 private:
     const char *m_token_type;
     const char *m_parser_name;
+    std::string m_mode; // the mode the parser belongs to ("" is the default mode)
+    std::string m_pushed_mode; // the mode its tokens push, if m_pushes_mode
+    bool m_pushes_mode = false;
+    bool m_pops_mode = false; // its tokens go back to the previous mode
 
 public:
     // Utility function to standardize the name of the parser
@@ -211,6 +1249,55 @@ public:
     const char *token_type() const {
         return m_token_type;
     }
+
+    // adds the bytes a match of this parser can start with
+    // The tokenizer only tries the parser at the positions starting with one of those bytes
+    // By default a parser may start with any byte
+    virtual void start_bytes(std::bitset<256>& bytes) const {
+        bytes.set();
+    }
+
+    // returns what the parser matches, for the reports (like ParserProfile::report)
+    virtual std::string describe() const {
+        return "parser";
+    }
+
+    // returns the mode the parser belongs to (see Tokenizer::select_mode)
+    const std::string& mode() const {
+        return m_mode;
+    }
+
+    void set_mode(const std::string& mode) {
+        m_mode = mode;
+    }
+
+    // the tokens of the parser enter the mode: only the parsers of that mode are tried after them
+    TokenParser& push_mode(const std::string& mode) {
+        m_pushed_mode = mode;
+        m_pushes_mode = true;
+        m_pops_mode = false;
+        return *this;
+    }
+
+    // the tokens of the parser go back to the mode that was current before the last push
+    TokenParser& pop_mode() {
+        m_pushed_mode.clear();
+        m_pushes_mode = false;
+        m_pops_mode = true;
+        return *this;
+    }
+
+    bool pushes_mode() const {
+        return m_pushes_mode;
+    }
+
+    const std::string& pushed_mode() const {
+        return m_pushed_mode;
+    }
+
+    bool pops_mode() const {
+        return m_pops_mode;
+    }
 };
 
 template<typename T>
@@ -252,10 +1339,22 @@ public:
     // Destructor
     virtual ~TokenKeyword() = default;
 
+    void start_bytes(std::bitset<256>& bytes) const override {
+        if (m_keyword.empty()) {
+            bytes.set();
+        } else {
+            bytes.set(static_cast<unsigned char>(m_keyword[0]));
+        }
+    }
+
     // returns the keyword
     const std::string& keyword() const {
         return m_keyword;
     }
+
+    std::string describe() const override {
+        return "keyword " + m_keyword;
+    }
 };
 
 // This token parser parses a pair of begin and end strings
@@ -349,6 +1448,18 @@ public:
 
     // Destructor
     virtual ~TokenBeginEndPair() = default;
+
+    void start_bytes(std::bitset<256>& bytes) const override {
+        if (m_begin.empty()) {
+            bytes.set();
+        } else {
+            bytes.set(static_cast<unsigned char>(m_begin[0]));
+        }
+    }
+
+    std::string describe() const override {
+        return "pair " + m_begin + " " + m_end;
+    }
 };
 
 class RegexParser : public TokenParserProxy<RegexParser> {
@@ -358,7 +1469,7 @@ public:
         auto& regex = static_cast<RegexParser&>(parser);
 
         std::smatch match;
-        if (s.regex_match(regex.regex(), match)) {
+        if (s.regex_match(regex.regex(), match, regex.anchored())) {
             if (match.size() == 0) {
                 return nullptr;
             }
@@ -371,19 +1482,65 @@ public:
 
 private:
     std::regex m_regex;
+    std::string m_pattern;
+    bool m_anchored;
+
+    // returns true if the pattern starts with ^ and has no alternative outside of a group, that the ^ would
+    // not cover (the escapes and the bracket expressions are skipped)
+    static bool starts_anchored(const std::string& pattern) {
+        if (pattern.empty() || pattern[0] != '^') {
+            return false;
+        }
+        size_t depth = 0;
+        bool in_brackets = false;
+        for (size_t i = 1; i < pattern.size(); ++i) {
+            const char c = pattern[i];
+            if (c == '\\') {
+                ++i;
+            } else if (in_brackets) {
+                in_brackets = c != ']';
+            } else if (c == '[') {
+                in_brackets = true;
+            } else if (c == '(') {
+                ++depth;
+            } else if (c == ')') {
+                depth -= depth != 0;
+            } else if (c == '|' && depth == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
 
 public:
     // create a new regex parser
     RegexParser(const std::string& regex, const char *type)
         : TokenParserProxy(type)
         , m_regex(regex)
+        , m_pattern(regex)
+        , m_anchored(starts_anchored(regex))
     {}
 
+    // returns true if the regex starts with ^: it only matches at the current position, which is
+    // checked without searching the rest of the string
+    bool anchored() const {
+        return m_anchored;
+    }
+
     // returns the regex
     const std::regex& regex() const {
         return m_regex;
     }
 
+    // returns the source of the regex
+    const std::string& pattern() const {
+        return m_pattern;
+    }
+
+    std::string describe() const override {
+        return "regex " + m_pattern;
+    }
+
     // Destructor
     virtual ~RegexParser() = default;
 };
@@ -402,13 +1559,11 @@ public:
     {}
 
     // add a new parser
-    void add_parser(std::unique_ptr<TokenParser> &&parser) {
-        m_parsers.push_back(std::move(parser));
-    }
+    void add_parser(std::unique_ptr<TokenParser> &&parser);
 
     // add a new parser
     void add_parser(TokenParser* parser) {
-        m_parsers.push_back(std::unique_ptr<TokenParser>(parser));
+        add_parser(std::unique_ptr<TokenParser>(parser));
     }
 
     // make a parser and add it
@@ -424,6 +1579,14 @@ public:
         return m_parsers;
     }
 
+    std::string describe() const override {
+        std::string out = "sequence of";
+        for (size_t i = 0; i < m_parsers.size(); ++i) {
+            out += (i == 0 ? " " : ", ") + m_parsers[i]->describe();
+        }
+        return out;
+    }
+
     // Destructor
     virtual ~CombinatorParser() = default;
 
@@ -432,229 +1595,5097 @@ public:
         return m_tokenizer_ref;
     }
 
+    // a combination starts like its first parser
+    void start_bytes(std::bitset<256>& bytes) const override {
+        if (m_parsers.empty()) {
+            bytes.set();
+        } else {
+            m_parsers.front()->start_bytes(bytes);
+        }
+    }
+
     static ParserCallbackResult parser_callback(FileTokenStream& s, TokenParser& parser);
 };
 
-// The tokenizer class is used to parse a string into tokens
-// It will orchestrate the parsing of the string, and will
-// call the appropriate parser for each token
-class Tokenizer {
+// A fixed size work stealing thread pool used by the parallel entry points of the tokenizer
+// Every worker owns a queue: the tasks submitted by a worker go to its own queue and
+// it runs them last in first out, idle workers steal the oldest tasks of the others.
+// Tasks submitted from outside of the pool are spread over the queues.
+class ThreadPool {
 private:
-    // the default token type
-    const char *m_default_type = "__default__";
-    // the token parsers
-    std::vector<std::unique_ptr<TokenParser>> m_representations;
-    // the callbacks for each token parser
-    std::unordered_map<const char *, ParserCallback> m_callbacks;
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
 
-    // whether or not to parse each token as a word
-    bool m_default_as_words = true;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::atomic<size_t> m_pending{0};
+    std::atomic<size_t> m_next_queue{0};
+    bool m_stop = false;
 
-    class TokenizerError : public std::exception {
-    private:
-        std::string m_message;
-        unsigned int m_line, m_column;
+    struct WorkerIdentity {
+        const ThreadPool* pool = nullptr;
+        size_t index = 0;
+    };
 
-    public:
-        TokenizerError(size_t line, size_t column)
-            : m_line(line), m_column(column)
+    static WorkerIdentity& current_worker() {
+        static thread_local WorkerIdentity identity;
+        return identity;
+    }
+
+    // pops a task of the given worker, or steals one from another worker
+    bool take_task(size_t index, std::function<void()>& task) {
         {
-            m_message = "Tokenizer error at line " + std::to_string(line) + ", column " + std::to_string(column);
+            auto& own = *m_queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
         }
-
-        virtual const char* what() const noexcept override {
-            return m_message.c_str();
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            auto& victim = *m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
         }
+        return false;
+    }
 
-        unsigned int line() const {
-            return m_line;
+    // runs one pending task on the given worker, returns false if there was none
+    bool run_one(size_t index) {
+        std::function<void()> task;
+        if (!take_task(index, task)) {
+            return false;
         }
+        m_pending.fetch_sub(1);
+        task();
+        return true;
+    }
 
-        unsigned int column() const {
-            return m_column;
+    void worker_loop(size_t index) {
+        current_worker() = { this, index };
+        for (;;) {
+            if (run_one(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_stop || m_pending.load() != 0; });
+            if (m_stop && m_pending.load() == 0) {
+                return;
+            }
         }
-    };
-
+    }
 
 public:
-    // register a new token parser
-    template<typename T>
-    void register_parser_callback() {
-        m_callbacks[TokenParser::GetParserTypeName<T>()] = T::parser_callback;
+    // create a pool of the given amount of threads (0 uses the hardware concurrency)
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            m_queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            m_workers.emplace_back([this, i] { worker_loop(i); });
+        }
     }
 
-    // create a new tokenizer
-    // It will register the default token parsers
-    // The default token parsers are:
-    // - Keyword
-    // - BeginEndPair
-    Tokenizer()
-    {
-        register_parser_callback<TokenKeyword>();
-        register_parser_callback<TokenBeginEndPair>();
-        register_parser_callback<RegexParser>();
-        register_parser_callback<CombinatorParser>();
-    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
-    // add a new token parser
-    inline void add_parser(std::unique_ptr<TokenParser> &&parser) {
-        m_representations.push_back(std::move(parser));
+    // Destructor, waits for the pending tasks to finish
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
     }
 
-    // add a new token parser
-    inline void add_parser(TokenParser* parser) {
-        m_representations.push_back(std::unique_ptr<TokenParser>(parser));
+    // returns the amount of worker threads
+    size_t size() const {
+        return m_workers.size();
     }
 
-    // make a parser and add it
-    template<typename T, typename... Args>
-    T &build_and_add_parser(Args&&... args) {
-        auto parser = new T(std::forward<Args>(args)...);
-        add_parser(parser);
-        return *parser;
+    // returns the index of the calling thread in the pool, or size() if it is not one of its workers
+    size_t worker_index() const {
+        const auto& identity = current_worker();
+        return identity.pool == this ? identity.index : size();
     }
 
-    // add a new keyword token parser
-    void add_keyword(const std::string& keyword, const char *type) {
-        add_parser(new TokenKeyword(keyword, type));
+    // queue a task
+    void submit(std::function<void()> task) {
+        size_t index = worker_index();
+        if (index == size()) {
+            index = m_next_queue.fetch_add(1) % size();
+        }
+        // counted before being queued so that the count never goes below the queued tasks
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.fetch_add(1);
+        }
+        {
+            auto& queue = *m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        m_condition.notify_one();
     }
 
-    // add a new begin/end pair token parser
-    void add_begin_end_pair(const std::string& begin, const std::string& end,
-                            bool keep_begin, bool keep_end,
-                            const char *type) {
-        add_parser(new TokenBeginEndPair(begin, end, keep_begin, keep_end, type));
-    }
+    // runs fn(i) for every i in [0, count) on the pool and waits for all of them
+    // When called from a worker, the worker runs pending tasks while it waits (so nesting is fine)
+    // The first exception thrown by fn is rethrown once every task is done
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t remaining = count;
+        std::exception_ptr error;
 
-    // add a new regex token parser
-    void add_regex(const std::string& regex, const char *type) {
-        add_parser(new RegexParser(regex, type));
-    }
+        for (size_t i = 0; i < count; ++i) {
+            submit([&, i] {
+                std::exception_ptr task_error;
+                try {
+                    fn(i);
+                } catch (...) {
+                    task_error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (task_error && !error) {
+                    error = task_error;
+                }
+                if (--remaining == 0) {
+                    done.notify_all();
+                }
+            });
+        }
 
-    // set the default token type
-    // This is the token type that will be used when a token
-    // is not recognized by any of the token parsers and is parsed as an identifier
-    void set_default_type(const char *type) {
-        m_default_type = type;
+        const size_t index = worker_index();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (remaining != 0) {
+            if (index != size()) {
+                lock.unlock();
+                const bool ran = run_one(index);
+                lock.lock();
+                if (ran) {
+                    continue;
+                }
+                done.wait_for(lock, std::chrono::microseconds(100), [&] { return remaining == 0; });
+            } else {
+                done.wait(lock, [&] { return remaining == 0; });
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
+};
 
-    // Set the default token parser as words
-    // This means that the default token parser will parse the string as a sequence of words
-    // A word is a sequence of characters that are not spaces
-    // The default token parser will parse the string as a sequence of words
-    // and will return a token for each word
-    void set_default_as_words() {
-        m_default_as_words = true;
+inline void StructuralIndex::build(const std::string& str, const ByteClasses& classes, ThreadPool* pool) {
+    m_blocks.resize((str.size() + 63) / 64);
+    m_size = str.size();
+    m_delimiter_bytes = classes.delimiter;
+
+    const size_t ranges = pool != nullptr ? pool->size() * 4 : 1;
+    const size_t per_range = (m_blocks.size() + ranges - 1) / ranges;
+
+    if (ranges == 1 || per_range < 1024) {
+        build_blocks(str, classes, 0, m_blocks.size());
+        return;
     }
 
-    // Set the default token parser as until parser match
-    // This means that the default token parser will parse the string as a single token
-    // until it finds a token that matches one of the token parsers
-    // The default token parser will parse the string as a single token
-    // until it finds a token that matches one of the token parsers
-    // and will return a token for the string until the match
-    void set_default_as_until_parser_match() {
-        m_default_as_words = false;
+    // every range is built as if it started outside of quotes,
+    // then the ranges preceded by an odd amount of quotes are flipped
+    std::vector<char> ends_inside(ranges, 0);
+    pool->parallel_for(ranges, [&](size_t r) {
+        const size_t first = std::min(m_blocks.size(), r * per_range);
+        ends_inside[r] = build_blocks(str, classes, first, std::min(m_blocks.size(), first + per_range));
+    });
+    std::vector<char> starts_inside(ranges, 0);
+    for (size_t r = 1; r < ranges; ++r) {
+        starts_inside[r] = starts_inside[r - 1] ^ ends_inside[r - 1];
     }
+    pool->parallel_for(ranges, [&](size_t r) {
+        if (!starts_inside[r]) {
+            return;
+        }
+        const size_t first = std::min(m_blocks.size(), r * per_range);
+        const size_t last = std::min(m_blocks.size(), first + per_range);
+        for (size_t b = first; b < last; ++b) {
+            const uint64_t valid = b * 64 + 64 > m_size ? (uint64_t(1) << (m_size - b * 64)) - 1 : ~uint64_t(0);
+            m_blocks[b].quoted = ~m_blocks[b].quoted & valid;
+        }
+    });
+}
 
+// Options of Tokenizer::load_or_tokenize
+struct TokenCacheOptions {
+    // the cache file, the path of the source followed by .toks when empty
+    std::string cache_path;
+    // a cache whose source had the same size and modification time is used without reading the source,
+    // otherwise the source is read and compared by its hash
+    bool trust_timestamp = true;
+};
 
-    // tokenize a string
-    // This will parse the string and return a vector of tokens
-    // Each token will have a type, a value, and a position
-    // If the token is not recognized by any of the token parsers
-    // it will be parsed as an identifier
-    // The identifier is a token that does not match any of the token parsers
-    // If the tokenize is not allowed to parse default identifiers it will throw an exception
-    // with the position of the first unrecognized token
-    std::vector<TokenInfo> tokenize(const std::string& str, bool allow_default_identifiers = true) {
-        FileTokenStream stream(str);
-        std::vector<TokenInfo> tokens;
-        auto try_parsers = [&]() -> bool {
-            for (auto& rep : m_representations) {
-                auto token = m_callbacks[rep->parser_type()](stream, *rep);
-                if (token != nullptr) {
-                    tokens.push_back(*token);
-                    return true;
-                }
-            }
-            return false;
-        };
+// Options of SpillingTokens
+struct SpillOptions {
+    // the memory for the packed tokens (see PackedToken), the blocks past it are written to a temporary file
+    size_t memory_budget = 64 << 20;
+    // the tokens of a block
+    size_t block_tokens = 16384;
+    // the directory of the temporary file, TMPDIR (or /tmp) when empty
+    std::string directory;
+};
 
-        while (!stream.eof()) {
-            stream.skip_whitespace();
+// Options of SharedTokenRing::create
+struct SharedRingOptions {
+    // the tokens the ring holds (rounded up to a power of two)
+    size_t capacity = 1 << 16;
+    // the bytes of the values the ring holds (a value cannot be longer)
+    size_t text_capacity = 16 << 20;
+    // the bytes of the type names, and their amount
+    size_t names_capacity = 64 << 10;
+    size_t max_types = 4096;
+};
 
-            if (stream.eof()) {
-                break;
-            }
+// Options of Tokenizer::tokenize_parallel
+struct ParallelTokenizeOptions {
+    // the approximate size of a chunk, chunks are always cut right after a newline
+    size_t chunk_size = 1 << 20;
+    // the pool to run the chunks on, a temporary pool is created when null
+    ThreadPool* pool = nullptr;
+};
 
-            if (try_parsers()) {
-                continue;
-            }
+// Options of Tokenizer::tokenize_many
+struct BatchTokenizeOptions {
+    // consecutive documents smaller than split_size are grouped in tasks of about this many bytes
+    size_t batch_size = 64 << 10;
+    // documents of at least this size are tokenized with tokenize_parallel
+    size_t split_size = 8 << 20;
+    // the pool to run the documents on, a temporary pool is created when null
+    ThreadPool* pool = nullptr;
+};
 
-            if (!allow_default_identifiers) {
-                throw TokenizerError(stream.line(), stream.column());
-            }
+// Receives the tokens of one document of Tokenizer::tokenize_many (from any thread of the pool)
+// The tokens may be moved away, when error is set they are the tokens found before the error
+using DocumentSink = std::function<void(size_t document, std::vector<TokenInfo>& tokens, std::exception_ptr error)>;
 
-            auto token = make_parser_callback_result(m_default_type, "", stream.line(), stream.column());
+// The memory reused between the calls to Tokenizer::tokenize that are given the same context
+// A context must not be used by several threads at once
+class TokenizerContext {
+public:
+    // the tokens of the last call
+    std::vector<TokenInfo> tokens;
 
-            // parse the default identifier as a word
-            if (m_default_as_words) {
-                while (!stream.eof() && !stream.is_whitespace()) {
-                    token->value += stream.peek();
-                    stream.next();
-                }
-                tokens.push_back(*token);
-                continue;
-            }
+private:
+    friend class Tokenizer;
 
-            // parse the default identifier as a sequence of characters until a parser matches
-            while (!stream.eof() && !stream.is_whitespace()) {
-                token->value += stream.peek();
-                stream.next();
+    std::string m_normalized;
+    StructuralIndex m_index;
+};
 
-                if (try_parsers()) {
-                    tokens.insert(tokens.end() - 1, *token); // insert the identifier before the token that was found
-                    token = nullptr;
-                    break;
-                }
-            }
+// An edit of a text: the removed bytes at offset are replaced by inserted
+struct TextEdit {
+    size_t offset = 0;
+    size_t removed = 0;
+    std::string inserted;
+};
+
+// The counters of a parser in a ParserProfile
+struct ParserCounters {
+    uint64_t attempts = 0; // the times the parser was tried
+    uint64_t hits = 0; // the times it returned a token
+    uint64_t bytes = 0; // the bytes its tokens were lexed from
+    uint64_t ticks = 0; // the time spent in the parser (see ParserProfile::now)
+
+    uint64_t misses() const {
+        return attempts - hits;
+    }
+};
+
+// Opt-in counters of the lexing, filled by Tokenizer::tokenize(str, profile):
+// the attempts, hits, bytes and time of every parser (indexed like Tokenizer::parsers)
+// and the totals of the calls. The counters add up over the calls until clear().
+// Only one attempt in sample_interval is timed (its time is scaled), as reading the clock
+// costs about as much as trying a keyword.
+class ParserProfile {
+public:
+    std::vector<ParserCounters> parsers;
+    uint64_t calls = 0;
+    uint64_t bytes = 0; // the bytes lexed
+    uint64_t tokens = 0;
+    uint64_t default_identifiers = 0; // the tokens of the default type (when no parser matched)
+    uint64_t regex_searches = 0; // see FileTokenStream::regex_searches
+    uint64_t ticks = 0; // the time of the calls
+
+    explicit ParserProfile(uint32_t sample_interval = 1)
+        : m_sample_interval(std::max<uint32_t>(sample_interval, 1))
+        , m_countdown(m_sample_interval)
+    {}
+
+    uint32_t sample_interval() const {
+        return m_sample_interval;
+    }
+
+    void clear() {
+        *this = ParserProfile(m_sample_interval);
+    }
+
+    // returns the current time in ticks: the time stamp counter on x86 (cycles of a constant
+    // frequency clock), nanoseconds elsewhere
+    static uint64_t now() {
+#if defined(TOKS_HAS_RDTSC)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    // returns the counters as a table, the most expensive parsers first
+    std::string report(const Tokenizer& tokenizer) const;
+
+private:
+    friend class Tokenizer;
+
+    uint32_t m_sample_interval;
+    uint32_t m_countdown;
+
+    // calls the parser and counts the call
+    template<typename F>
+    ParserCallbackResult attempt(uint32_t parser, const FileTokenStream& stream, F&& call) {
+        auto& counters = parsers[parser];
+        ++counters.attempts;
+        const size_t pos = stream.pos();
+        ParserCallbackResult token;
+        if (--m_countdown == 0) {
+            m_countdown = m_sample_interval;
+            const uint64_t start = now();
+            token = call();
+            counters.ticks += (now() - start) * m_sample_interval;
+        } else {
+            token = call();
+        }
+        if (token != nullptr) {
+            ++counters.hits;
+            counters.bytes += stream.pos() - pos;
+        }
+        return token;
+    }
+};
+
+// The events of the lexer, for Tokenizer::tokenize_traced
+// A trace policy derives from NoTrace and hides the hooks it needs; the hooks of NoTrace do nothing
+// and compile away, so the lexer costs the same without a policy.
+// (the parsers are indexed like Tokenizer::parsers, the modes like their order of registration)
+struct NoTrace {
+    // a token was added to the output (in the order of the output)
+    void token_emitted(const TokenInfo&) {}
+    // a parser was tried at the offset
+    void parser_attempted(uint32_t /* parser */, size_t /* offset */, bool /* matched */) {}
+    // a token entered a mode, or went back from one
+    void mode_pushed(uint32_t /* mode */, size_t /* offset */) {}
+    void mode_popped(uint32_t /* mode */, size_t /* offset */) {}
+    // the lexer is about to throw a TokenizerError
+    void error(size_t /* line */, size_t /* column */) {}
+};
+
+// An event recorded by TraceRing
+struct TraceEvent {
+    enum Kind : uint8_t { Token, Attempt, Hit, Push, Pop, Error };
+
+    Kind kind;
+    uint32_t id; // the parser (Attempt, Hit) or the mode (Push, Pop)
+    size_t offset; // the offset of the event (the line for an Error)
+    const char *token_type; // the type of a Token
+};
+
+// A trace policy that keeps the last events in a ring buffer (to dump them after an error for example)
+class TraceRing : public NoTrace {
+private:
+    std::vector<TraceEvent> m_events;
+    size_t m_next = 0;
+    size_t m_count = 0;
+
+    void add(TraceEvent::Kind kind, uint32_t id, size_t offset, const char *token_type = nullptr) {
+        m_events[m_next] = TraceEvent{kind, id, offset, token_type};
+        m_next = m_next + 1 == m_events.size() ? 0 : m_next + 1;
+        ++m_count;
+    }
+
+public:
+    explicit TraceRing(size_t capacity = 4096)
+        : m_events(std::max<size_t>(capacity, 1))
+    {}
+
+    void token_emitted(const TokenInfo& token) {
+        add(TraceEvent::Token, 0, token.offset, token.token_type);
+    }
+
+    void parser_attempted(uint32_t parser, size_t offset, bool matched) {
+        add(matched ? TraceEvent::Hit : TraceEvent::Attempt, parser, offset);
+    }
+
+    void mode_pushed(uint32_t mode, size_t offset) {
+        add(TraceEvent::Push, mode, offset);
+    }
+
+    void mode_popped(uint32_t mode, size_t offset) {
+        add(TraceEvent::Pop, mode, offset);
+    }
+
+    void error(size_t line, size_t column) {
+        add(TraceEvent::Error, static_cast<uint32_t>(column), line);
+    }
+
+    // returns the amount of events since the start (the ring keeps the last capacity ones)
+    size_t count() const {
+        return m_count;
+    }
+
+    // returns the events in the ring, the oldest first
+    std::vector<TraceEvent> events() const {
+        std::vector<TraceEvent> out;
+        if (m_count > m_events.size()) {
+            out.insert(out.end(), m_events.begin() + m_next, m_events.end());
+        }
+        out.insert(out.end(), m_events.begin(), m_events.begin() + m_next);
+        return out;
+    }
+
+    void clear() {
+        m_next = 0;
+        m_count = 0;
+    }
+};
+
+namespace detail {
+
+// writes the bytes to a temporary file renamed over the path, returns false if it cannot
+// The temporary file is a new one next to the path (mkstemp), so that processes writing the same path at
+// once never write to the same file: the last rename wins with a whole file.
+inline bool write_file_atomically(const std::string& path, const char *data, size_t size) {
+#if defined(TOKS_HAS_POSIX_IO)
+    std::string temporary = path + ".XXXXXX";
+    const int fd = mkstemp(&temporary[0]);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t written = ::write(fd, data + done, size - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            ::close(fd);
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        done += static_cast<size_t>(written);
+    }
+    // (mkstemp makes the file readable by its owner only)
+    fchmod(fd, 0644);
+    if (::close(fd) != 0) {
+        ::unlink(temporary.c_str());
+        return false;
+    }
+#else
+    static std::atomic<uint64_t> written{0};
+    const std::string temporary = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()))
+                                  + "." + std::to_string(++written);
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(data, static_cast<std::streamsize>(size));
+        if (!file.flush()) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace detail
+
+// Counters of the tokenization of a long-running service: the calls, the bytes lexed, the tokens of every
+// type, the errors and the time, filled by Tokenizer::tokenize(str, metrics) from any amount of threads.
+// Every thread adds to its own counters (no lock nor shared cache line once it has made its first call),
+// a read sums the counters of all the threads. The counters only grow, as Prometheus counters do.
+class TokenizerMetrics {
+public:
+    struct Values {
+        uint64_t calls = 0;
+        uint64_t bytes = 0;
+        uint64_t tokens = 0;
+        uint64_t errors = 0; // the calls that threw
+        uint64_t nanoseconds = 0; // the time of the calls
+        std::map<std::string, uint64_t> tokens_by_type;
+    };
+
+private:
+    // the amount of distinct token types counted per thread, the others are counted under "other"
+    static constexpr size_t type_slots = 64;
+    // the amount of metrics whose counters a thread finds without a lock (the last ones it used)
+    static constexpr size_t recent_metrics = 4;
+
+    struct TypeCount {
+        std::atomic<const char *> type{nullptr};
+        std::atomic<uint64_t> count{0};
+    };
+
+    // the counters of one thread (written by it only)
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> tokens{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> nanoseconds{0};
+        std::atomic<uint64_t> other_types{0};
+        TypeCount types[type_slots];
+    };
+
+    const uint64_t m_id;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::unordered_map<std::thread::id, Shard *> m_thread_shards;
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    // (only the thread of the counter writes it, a load and a store are enough)
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // returns the counters of the calling thread, made on its first call
+    Shard& local_shard() {
+        // the shards of the last metrics the thread used, by id (an address could be reused, an id is not)
+        // The others are found under the lock, so a thread keeps nothing of the metrics destroyed since.
+        struct Recent {
+            uint64_t id = 0;
+            Shard *shard = nullptr;
+        };
+        static thread_local Recent recent[recent_metrics];
+        static thread_local size_t replaced = 0;
+        for (auto& entry : recent) {
+            if (entry.id == m_id) {
+                return *entry.shard;
+            }
+        }
+        Shard *shard;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Shard *& found = m_thread_shards[std::this_thread::get_id()];
+            if (found == nullptr) {
+                m_shards.push_back(std::make_unique<Shard>());
+                found = m_shards.back().get();
+            }
+            shard = found;
+        }
+        recent[replaced] = Recent{m_id, shard};
+        replaced = (replaced + 1) % recent_metrics;
+        return *shard;
+    }
+
+    static std::atomic<uint64_t>& type_count(Shard& shard, const char *type) {
+        if (type == nullptr) {
+            return shard.other_types;
+        }
+        const size_t hash = std::hash<const char *>()(type);
+        for (size_t i = 0; i < type_slots; ++i) {
+            auto& slot = shard.types[(hash + i) % type_slots];
+            const char *slot_type = slot.type.load(std::memory_order_relaxed);
+            if (slot_type == type) {
+                return slot.count;
+            }
+            if (slot_type == nullptr) {
+                slot.type.store(type, std::memory_order_release);
+                return slot.count;
+            }
+        }
+        return shard.other_types;
+    }
+
+    static void escape_label(std::string& out, const std::string& value) {
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+    }
+
+public:
+    TokenizerMetrics()
+        : m_id(next_id())
+    {}
+
+    TokenizerMetrics(const TokenizerMetrics&) = delete;
+    TokenizerMetrics& operator=(const TokenizerMetrics&) = delete;
+
+    // counts a call that lexed bytes into the tokens
+    void record(size_t bytes, const std::vector<TokenInfo>& tokens, uint64_t nanoseconds) {
+        Shard& shard = local_shard();
+        add(shard.calls, 1);
+        add(shard.bytes, bytes);
+        add(shard.tokens, tokens.size());
+        add(shard.nanoseconds, nanoseconds);
+        // (the tokens of a type often follow each other)
+        const char *type = nullptr;
+        uint64_t run = 0;
+        for (auto& token : tokens) {
+            if (token.token_type != type) {
+                if (run != 0) {
+                    add(type_count(shard, type), run);
+                }
+                type = token.token_type;
+                run = 0;
+            }
+            ++run;
+        }
+        if (run != 0) {
+            add(type_count(shard, type), run);
+        }
+    }
+
+    // counts a call that threw
+    void record_error(size_t bytes, uint64_t nanoseconds) {
+        Shard& shard = local_shard();
+        add(shard.calls, 1);
+        add(shard.errors, 1);
+        add(shard.bytes, bytes);
+        add(shard.nanoseconds, nanoseconds);
+    }
+
+    // returns the sums of the counters of all the threads
+    Values values() const {
+        Values values;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& shard : m_shards) {
+            values.calls += shard->calls.load(std::memory_order_relaxed);
+            values.bytes += shard->bytes.load(std::memory_order_relaxed);
+            values.tokens += shard->tokens.load(std::memory_order_relaxed);
+            values.errors += shard->errors.load(std::memory_order_relaxed);
+            values.nanoseconds += shard->nanoseconds.load(std::memory_order_relaxed);
+            for (auto& slot : shard->types) {
+                const char *type = slot.type.load(std::memory_order_acquire);
+                if (type != nullptr) {
+                    values.tokens_by_type[type] += slot.count.load(std::memory_order_relaxed);
+                }
+            }
+            if (const uint64_t other = shard->other_types.load(std::memory_order_relaxed)) {
+                values.tokens_by_type["other"] += other;
+            }
+        }
+        return values;
+    }
+
+    // returns the counters in the Prometheus text exposition format, their names starting with the prefix
+    std::string prometheus(const std::string& prefix = "toks") const {
+        const Values v = values();
+        std::string out;
+        char number[32];
+        auto counter = [&](const char *name, const char *help, const std::string& value) {
+            out += "# HELP " + prefix + name + " " + help + "\n";
+            out += "# TYPE " + prefix + name + " counter\n";
+            out += prefix + name + " " + value + "\n";
+        };
+        counter("_tokenize_calls_total", "Calls to tokenize.", std::to_string(v.calls));
+        counter("_bytes_total", "Bytes lexed.", std::to_string(v.bytes));
+        counter("_errors_total", "Calls to tokenize that threw.", std::to_string(v.errors));
+        snprintf(number, sizeof(number), "%.9f", static_cast<double>(v.nanoseconds) / 1e9);
+        counter("_tokenize_seconds_total", "Time spent in tokenize.", number);
+
+        out += "# HELP " + prefix + "_tokens_total Tokens produced, by type.\n";
+        out += "# TYPE " + prefix + "_tokens_total counter\n";
+        for (auto& type : v.tokens_by_type) {
+            out += prefix + "_tokens_total{type=\"";
+            escape_label(out, type.first);
+            out += "\"} " + std::to_string(type.second) + "\n";
+        }
+        return out;
+    }
+
+    // writes the Prometheus text to the file (through a temporary file renamed over it, so that a
+    // collector never reads half of it, like the textfile collector of the node exporter expects)
+    void write_prometheus(const std::string& path, const std::string& prefix = "toks") const {
+        const std::string text = prometheus(prefix);
+        if (!detail::write_file_atomically(path, text.data(), text.size())) {
+            throw std::system_error(errno, std::generic_category(), "Could not write " + path);
+        }
+    }
+};
+
+// A problem of a grammar found by Tokenizer::analyze
+// (the parsers are indexed like Tokenizer::parsers)
+struct GrammarIssue {
+    enum Kind : uint8_t {
+        ShadowedKeyword, // a keyword (or the begin of a pair) starts with an earlier keyword: it never matches
+        EmptyRegex, // a regex can match the empty string: the lexer would not move forward
+        OverlappingBegin, // the begin of a pair starts with the begin of another pair of the same mode
+    };
+
+    Kind kind;
+    size_t parser;
+    size_t other; // the earlier parser that shadows or overlaps it (parser for an EmptyRegex)
+    std::string message;
+};
+
+// The report of Tokenizer::analyze
+struct GrammarReport {
+    std::vector<GrammarIssue> issues;
+    // the parsers tried at a byte, on average over the bytes (and modes) where at least one may start
+    double candidates_per_byte = 0;
+    size_t max_candidates = 0; // at the byte max_candidates_byte (of the mode max_candidates_mode)
+    unsigned char max_candidates_byte = 0;
+    std::string max_candidates_mode;
+    size_t any_byte_parsers = 0; // the parsers that may start with any byte (tried everywhere)
+
+    // returns the issues and the dispatch cost, a line each
+    std::string report() const {
+        std::string out;
+        for (auto& issue : issues) {
+            out += issue.message;
+            out += '\n';
+        }
+        char line[160];
+        const unsigned char c = max_candidates_byte;
+        snprintf(line, sizeof(line), "%.2f candidate parsers per first byte, at most %zu at byte '%c' (0x%02x)"
+                 ", %zu parsers tried at any byte\n", candidates_per_byte, max_candidates,
+                 c >= 0x20 && c < 0x7f ? static_cast<char>(c) : '?', c, any_byte_parsers);
+        out += line;
+        return out;
+    }
+};
+
+namespace detail {
+
+// The distinct stacks of lexer modes met while lexing, so that a token can refer to its stack by an id
+// (0 is the empty stack of the default mode)
+class ModeStates {
+private:
+    std::vector<std::vector<uint32_t>> m_stacks = { {} };
+    std::map<std::vector<uint32_t>, uint32_t> m_ids;
+
+public:
+    uint32_t intern(const std::vector<uint32_t>& stack) {
+        if (stack.empty()) {
+            return 0;
+        }
+        auto found = m_ids.find(stack);
+        if (found != m_ids.end()) {
+            return found->second;
+        }
+        const auto id = static_cast<uint32_t>(m_stacks.size());
+        m_stacks.push_back(stack);
+        m_ids.emplace(stack, id);
+        return id;
+    }
+
+    const std::vector<uint32_t>& operator[](uint32_t id) const {
+        return m_stacks[id];
+    }
+};
+
+// What the lexer records besides the tokens (every vector is optional)
+struct LexRecord {
+    // the start of every token along with the amount of tokens emitted before it
+    std::vector<std::pair<size_t, size_t>>* boundaries = nullptr;
+    // for every token, one past the last byte looked at to lex it
+    std::vector<size_t>* reaches = nullptr;
+    // for every token, the end of the bytes it was lexed from
+    std::vector<size_t>* ends = nullptr;
+    // for every token, the id in mode_states of the stack of modes its lexing started with
+    std::vector<uint32_t>* states = nullptr;
+    ModeStates* mode_states = nullptr;
+    // the counters of the parsers
+    ParserProfile* profile = nullptr;
+};
+
+} // namespace detail
+
+// A text and its tokens, kept up to date by Tokenizer::retokenize
+// The text is normalized (see FileTokenStream::normalize): the offsets of the edits and of
+// the tokens are offsets in the normalized text.
+class TokenizedText {
+public:
+    const std::string& text() const {
+        return m_text;
+    }
+
+    const std::vector<TokenInfo>& tokens() const {
+        return m_tokens;
+    }
+
+private:
+    friend class Tokenizer;
+
+    std::string m_text;
+    std::vector<TokenInfo> m_tokens;
+    std::vector<size_t> m_reaches; // for every token, one past the last byte looked at to lex it
+    std::vector<uint32_t> m_states; // for every token, the lexer modes it started in
+    detail::ModeStates m_mode_states;
+    bool m_allow_default_identifiers = true;
+};
+
+// A place where lexing can restart (see LexerSnapshots)
+struct LexerSnapshot {
+    size_t offset = 0; // the offset, line and column of the first token that reaches the line of the snapshot
+    size_t line = 0;
+    size_t column = 0;
+    bool inside_token = false; // the line starts inside that token (like a comment over several lines)
+    std::vector<uint32_t> modes; // the lexer modes that token started in
+};
+
+// Restart points recorded every interval lines while a text is tokenized
+// (see Tokenizer::tokenize_lines), to lex a range of lines (like the visible part of a huge file)
+// without lexing what comes before it
+class LexerSnapshots {
+public:
+    explicit LexerSnapshots(size_t interval = 256)
+        : m_interval(std::max<size_t>(1, interval))
+    {}
+
+    // returns the normalized text
+    const std::string& text() const {
+        return m_text;
+    }
+
+    size_t interval() const {
+        return m_interval;
+    }
+
+    size_t size() const {
+        return m_snapshots.size();
+    }
+
+    // returns the snapshot of the line index * interval
+    const LexerSnapshot& operator[](size_t index) const {
+        return m_snapshots[index];
+    }
+
+    // returns the snapshot to start from to lex the given line
+    const LexerSnapshot& before_line(size_t line) const {
+        return m_snapshots[std::min(line / m_interval, m_snapshots.size() - 1)];
+    }
+
+private:
+    friend class Tokenizer;
+
+    size_t m_interval;
+    std::string m_text;
+    std::vector<LexerSnapshot> m_snapshots;
+    bool m_allow_default_identifiers = true;
+
+    // returns the line of the last byte of the token that ends at end
+    size_t last_line(const TokenInfo& token, size_t end) const {
+        if (end <= token.offset + 1) {
+            return token.line;
+        }
+        return token.line + static_cast<size_t>(std::count(m_text.begin() + static_cast<std::ptrdiff_t>(token.offset),
+                                                           m_text.begin() + static_cast<std::ptrdiff_t>(end - 1), '\n'));
+    }
+
+    // records a snapshot for every interval lines, from the tokens of the whole text
+    void record(const std::vector<TokenInfo>& tokens, const std::vector<size_t>& ends, const std::vector<uint32_t>& states,
+                const detail::ModeStates& mode_states, const FileTokenStream& end) {
+        m_snapshots.assign(1, LexerSnapshot());
+        size_t line = m_interval;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            // a token can only reach the line if the next one starts after it
+            if (i + 1 < tokens.size() && tokens[i + 1].line < line) {
+                continue;
+            }
+            const TokenInfo& token = tokens[i];
+            for (const size_t reached = last_line(token, ends[i]); reached >= line; line += m_interval) {
+                m_snapshots.push_back(LexerSnapshot{token.offset, token.line, token.column, token.line < line,
+                                                    mode_states[states[i]]});
+            }
+        }
+        // the lines after the last token have nothing left to lex
+        for (; line <= end.line(); line += m_interval) {
+            m_snapshots.push_back(LexerSnapshot{m_text.size(), end.line(), end.column(), false, end.modes()});
+        }
+    }
+};
+
+// The tokenizer class is used to parse a string into tokens
+// It will orchestrate the parsing of the string, and will
+// call the appropriate parser for each token
+class Tokenizer {
+private:
+    // the default token type
+    const char *m_default_type = "__default__";
+    // the token parsers
+    std::vector<std::unique_ptr<TokenParser>> m_representations;
+    // the callbacks for each token parser
+    std::unordered_map<const char *, ParserCallback> m_callbacks;
+
+    // whether or not to parse each token as a word
+    bool m_default_as_words = true;
+
+    // whether or not to build a structural index before lexing
+    bool m_structural_index = false;
+    // the mode of the parsers that are added
+    std::string m_mode;
+
+    // The parsers to try for each first byte, compiled from the registered parsers
+    // when tokenizing and dropped whenever a parser is added
+    struct DispatchTable {
+        // what happens to the mode stack after a token of a parser
+        static constexpr int32_t stay = -1;
+        static constexpr int32_t pop = -2; // otherwise the mode that is pushed
+
+        // the parsers of a mode
+        struct Mode {
+            // the parsers that may start with the byte c are candidates[offsets[c]..offsets[c + 1]]
+            std::vector<uint32_t> offsets;
+            std::vector<uint32_t> candidates;
+
+            // returns true if no parser may start with the byte
+            bool no_candidate(unsigned char c) const {
+                return offsets[c] == offsets[c + 1];
+            }
+        };
+
+        // the callback of each parser
+        std::vector<const ParserCallback *> callbacks;
+        std::vector<int32_t> transitions;
+        // the modes by id (the default mode is 0), and their names
+        std::vector<Mode> modes;
+        std::vector<std::string> mode_names;
+        // the bytes indexed by the structural index (for all the modes)
+        StructuralIndex::ByteClasses classes;
+    };
+    mutable std::shared_ptr<const DispatchTable> m_dispatch;
+
+    class TokenizerError : public std::exception {
+    private:
+        std::string m_message;
+        unsigned int m_line, m_column;
+
+    public:
+        TokenizerError(size_t line, size_t column)
+            : m_line(line), m_column(column)
+        {
+            m_message = "Tokenizer error at line " + std::to_string(line) + ", column " + std::to_string(column);
+        }
+
+        virtual const char* what() const noexcept override {
+            return m_message.c_str();
+        }
+
+        unsigned int line() const {
+            return m_line;
+        }
+
+        unsigned int column() const {
+            return m_column;
+        }
+    };
+
+
+public:
+    // register a new token parser
+    template<typename T>
+    void register_parser_callback() {
+        m_callbacks[TokenParser::GetParserTypeName<T>()] = T::parser_callback;
+        reset_dispatch_table();
+    }
+
+    // create a new tokenizer
+    // It will register the default token parsers
+    // The default token parsers are:
+    // - Keyword
+    // - BeginEndPair
+    Tokenizer()
+    {
+        register_parser_callback<TokenKeyword>();
+        register_parser_callback<TokenBeginEndPair>();
+        register_parser_callback<RegexParser>();
+        register_parser_callback<CombinatorParser>();
+    }
+
+    // add a new token parser
+    inline void add_parser(std::unique_ptr<TokenParser> &&parser) {
+        parser->set_mode(m_mode);
+        m_representations.push_back(std::move(parser));
+        reset_dispatch_table();
+    }
+
+    // selects the mode of the parsers added after this call ("" is the default mode)
+    // Lexing starts in the default mode, and only tries the parsers of the current mode:
+    // a parser enters a mode with TokenParser::push_mode and goes back with TokenParser::pop_mode.
+    void select_mode(const std::string& mode) {
+        m_mode = mode;
+    }
+
+    // add a new token parser
+    inline void add_parser(TokenParser* parser) {
+        add_parser(std::unique_ptr<TokenParser>(parser));
+    }
+
+    // drops the compiled dispatch table, it is compiled again on the next tokenize
+    // This is done when adding parsers, call it if you change a parser after adding it
+    void reset_dispatch_table() {
+        std::atomic_store(&m_dispatch, std::shared_ptr<const DispatchTable>());
+    }
+
+    // make a parser and add it
+    template<typename T, typename... Args>
+    T &build_and_add_parser(Args&&... args) {
+        auto parser = new T(std::forward<Args>(args)...);
+        add_parser(parser);
+        return *parser;
+    }
+
+    // add a new keyword token parser
+    TokenParser& add_keyword(const std::string& keyword, const char *type) {
+        return build_and_add_parser<TokenKeyword>(keyword, type);
+    }
+
+    // add a new begin/end pair token parser
+    TokenParser& add_begin_end_pair(const std::string& begin, const std::string& end,
+                                    bool keep_begin, bool keep_end,
+                                    const char *type) {
+        return build_and_add_parser<TokenBeginEndPair>(begin, end, keep_begin, keep_end, type);
+    }
+
+    // add a new regex token parser
+    TokenParser& add_regex(const std::string& regex, const char *type) {
+        return build_and_add_parser<RegexParser>(regex, type);
+    }
+
+    // set the default token type
+    // This is the token type that will be used when a token
+    // is not recognized by any of the token parsers and is parsed as an identifier
+    void set_default_type(const char *type) {
+        m_default_type = type;
+    }
+
+    // Set the default token parser as words
+    // This means that the default token parser will parse the string as a sequence of words
+    // A word is a sequence of characters that are not spaces
+    // The default token parser will parse the string as a sequence of words
+    // and will return a token for each word
+    void set_default_as_words() {
+        m_default_as_words = true;
+    }
+
+    // Set the default token parser as until parser match
+    // This means that the default token parser will parse the string as a single token
+    // until it finds a token that matches one of the token parsers
+    // The default token parser will parse the string as a single token
+    // until it finds a token that matches one of the token parsers
+    // and will return a token for the string until the match
+    void set_default_as_until_parser_match() {
+        m_default_as_words = false;
+    }
+
+    // Enable (or disable) the structural pre-index pass
+    // When enabled, the string is first scanned 64 bytes at a time into bitmasks of
+    // whitespace, newlines, parser start bytes, delimiters and quoted regions (see StructuralIndex).
+    // The lexer then jumps between the indexed positions instead of testing every byte.
+    // It costs a few bits per byte of memory and gives the same tokens.
+    void set_structural_index(bool enabled = true) {
+        m_structural_index = enabled;
+    }
+
+    // returns the registered parsers, in the order they are tried
+    const std::vector<std::unique_ptr<TokenParser>>& parsers() const {
+        return m_representations;
+    }
+
+    // returns the type of the default identifiers
+    const char *default_type() const {
+        return m_default_type;
+    }
+
+    // returns true if the default identifiers are words (see set_default_as_words)
+    bool default_as_words() const {
+        return m_default_as_words;
+    }
+
+    // returns the problems of the registered parsers (the shadowed keywords, the regexes that can match
+    // the empty string, the overlapping begins of pairs) and the cost of their dispatch
+    GrammarReport analyze() const;
+
+    // returns a hash of the registered parsers and of the options that change the tokens (see TokenCache)
+    // A parser of your own is known by its class, its token type and describe().
+    uint64_t fingerprint() const;
+
+    // returns the tokens of a file from its cache (see TokenCacheOptions), or tokenizes the file and
+    // writes the cache when it is missing, stale or made by another grammar
+    // The cache is still returned (from memory) when it cannot be written.
+    TokenCache load_or_tokenize(const std::string& path, const TokenCacheOptions& options = TokenCacheOptions()) const;
+
+    // tokenize a string into a container that moves the tokens to a temporary file past its memory budget
+    // (see SpillingTokens), the string is lexed a slice at a time so that the tokens are never all in memory
+    void tokenize(const std::string& str, SpillingTokens& tokens, bool allow_default_identifiers = true) const;
+
+    // tokenize a string and build the index of its tokens along the way
+    std::vector<TokenInfo> tokenize(const std::string& str, TokenIndex& index, bool allow_default_identifiers = true) const {
+        std::string normalized;
+        std::vector<TokenInfo> tokens;
+        std::vector<size_t> ends;
+        detail::LexRecord record;
+        record.ends = &ends;
+        index.clear();
+        // (the tokens of a slice are indexed while they are still in the cache)
+        lex_slices(normalized_source(str, normalized), allow_default_identifiers, tokens, record, [&]() {
+            for (size_t i = index.size(); i < tokens.size(); ++i) {
+                index.add(tokens[i], ends[i]);
+            }
+            return true;
+        });
+        return tokens;
+    }
+
+#if defined(TOKS_HAS_POSIX_IO)
+    // tokenize a string into a shared memory ring read by another process (see SharedTokenRing)
+    // returns false if the consumer cancelled the ring
+    bool tokenize(const std::string& str, SharedTokenRing& ring, bool allow_default_identifiers = true) const;
+#endif
+
+
+    // tokenize a string
+    // This will parse the string and return a vector of tokens
+    // Each token will have a type, a value, and a position
+    // If the token is not recognized by any of the token parsers
+    // it will be parsed as an identifier
+    // The identifier is a token that does not match any of the token parsers
+    // If the tokenize is not allowed to parse default identifiers it will throw an exception
+    // with the position of the first unrecognized token
+    std::vector<TokenInfo> tokenize(const std::string& str, bool allow_default_identifiers = true) const {
+        TokenizerContext context;
+        return std::move(tokenize(str, context, allow_default_identifiers));
+    }
+
+    // tokenize a string, reusing the memory of the context
+    // The tokens are returned in context.tokens, which is cleared first
+    std::vector<TokenInfo>& tokenize(const std::string& str, TokenizerContext& context,
+                                     bool allow_default_identifiers = true) const {
+        const std::string& source = normalized_source(str, context.m_normalized);
+        const auto table = dispatch_table();
+        auto stream = FileTokenStream::borrow(source);
+
+        context.tokens.clear();
+        if (m_structural_index) {
+            context.m_index.build(source, table->classes);
+            stream.set_index(&context.m_index);
+        }
+        lex(stream, *table, context.tokens, allow_default_identifiers);
+        return context.tokens;
+    }
+
+    // tokenize a string, calling the hooks of the trace policy on the events of the lexer (see NoTrace)
+    template<typename Trace>
+    std::vector<TokenInfo> tokenize_traced(const std::string& str, Trace& trace,
+                                           bool allow_default_identifiers = true) const {
+        std::string normalized;
+        const std::string& source = normalized_source(str, normalized);
+        const auto table = dispatch_table();
+        auto stream = FileTokenStream::borrow(source);
+
+        StructuralIndex index;
+        if (m_structural_index) {
+            index.build(source, table->classes);
+            stream.set_index(&index);
+        }
+        std::vector<TokenInfo> tokens;
+        lex(stream, *table, tokens, allow_default_identifiers, std::string::npos, detail::LexRecord(), trace);
+        return tokens;
+    }
+
+    // tokenize a string and add the counters of its lexing to the profile (see ParserProfile)
+    std::vector<TokenInfo> tokenize(const std::string& str, ParserProfile& profile,
+                                    bool allow_default_identifiers = true) const {
+        std::string normalized;
+        const std::string& source = normalized_source(str, normalized);
+        const auto table = dispatch_table();
+        auto stream = FileTokenStream::borrow(source);
+
+        StructuralIndex index;
+        if (m_structural_index) {
+            index.build(source, table->classes);
+            stream.set_index(&index);
+        }
+        std::vector<TokenInfo> tokens;
+        lex(stream, *table, tokens, allow_default_identifiers, std::string::npos,
+            {nullptr, nullptr, nullptr, nullptr, nullptr, &profile});
+        return tokens;
+    }
+
+    // tokenize a string and count the call in the metrics (see TokenizerMetrics)
+    std::vector<TokenInfo> tokenize(const std::string& str, TokenizerMetrics& metrics,
+                                    bool allow_default_identifiers = true) const {
+        const auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&]() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        };
+        std::vector<TokenInfo> tokens;
+        try {
+            tokens = tokenize(str, allow_default_identifiers);
+        } catch (...) {
+            metrics.record_error(str.size(), elapsed());
+            throw;
+        }
+        metrics.record(str.size(), tokens, elapsed());
+        return tokens;
+    }
+
+    // tokenize the string so that it can be tokenized again after edits (see retokenize)
+    TokenizedText tokenize_editable(const std::string& str, bool allow_default_identifiers = true) const {
+        TokenizedText text;
+        text.m_text = str;
+        FileTokenStream::normalize(text.m_text);
+        text.m_allow_default_identifiers = allow_default_identifiers;
+        FileTokenStream stream = FileTokenStream::borrow(text.m_text);
+        lex(stream, *dispatch_table(), text.m_tokens, allow_default_identifiers, std::string::npos,
+            {nullptr, &text.m_reaches, nullptr, &text.m_states, &text.m_mode_states});
+        return text;
+    }
+
+    // applies the edit to the text, and lexes again only the tokens that it may change
+    // Lexing restarts at the first token whose lexing looked at an edited byte, and stops as soon as a
+    // token starts where an old token after the edit started (in the same column and modes). The old tokens that
+    // follow are kept, with their offsets and lines shifted.
+    // returns the range [first, last) of the new tokens in text.tokens()
+    // On error (see allow_default_identifiers) the text and its tokens are left unchanged.
+    std::pair<size_t, size_t> retokenize(TokenizedText& text, const TextEdit& edit) const {
+        std::string& source = text.m_text;
+        std::vector<TokenInfo>& tokens = text.m_tokens;
+        std::vector<size_t>& reaches = text.m_reaches;
+        if (edit.offset > source.size() || edit.removed > source.size() - edit.offset) {
+            throw std::out_of_range("The edit is outside of the text");
+        }
+        std::string inserted = edit.inserted;
+        FileTokenStream::normalize(inserted);
+        const size_t begin = edit.offset;
+        const size_t removed = edit.removed;
+        const size_t added = inserted.size();
+        const size_t count = tokens.size();
+        auto shifted = [&](size_t offset) { return offset - removed + added; };
+
+        // the tokens before the first one that looked at an edited byte are the same,
+        // lexing restarts at that token if it starts before the edit (or at the one before it)
+        size_t first = static_cast<size_t>(std::find_if(reaches.begin(), reaches.end(),
+                                                        [begin](size_t reach) { return reach > begin; }) - reaches.begin());
+        if (first != 0 && (first == count || tokens[first].offset > begin)) {
+            --first;
+        }
+        FileTokenStream stream = FileTokenStream::borrow(source);
+        if (first < count && tokens[first].offset <= begin) {
+            stream.seek(tokens[first].offset, tokens[first].line, tokens[first].column);
+            stream.set_modes(text.m_mode_states[text.m_states[first]]);
+        }
+
+        // the old tokens after the edit are where the new ones may meet them again
+        size_t next = static_cast<size_t>(std::lower_bound(tokens.begin() + first, tokens.end(), begin + removed,
+                                                           [](const TokenInfo& token, size_t offset) { return token.offset < offset; })
+                                          - tokens.begin());
+
+        const std::string removed_text = source.substr(begin, removed);
+        source.replace(begin, removed, inserted);
+        std::vector<TokenInfo> fresh;
+        std::vector<size_t> fresh_reaches;
+        std::vector<uint32_t> fresh_states;
+        const detail::LexRecord record = {nullptr, &fresh_reaches, nullptr, &fresh_states, &text.m_mode_states};
+        try {
+            auto table = dispatch_table();
+            while (next < count) {
+                const size_t target = shifted(tokens[next].offset);
+                lex(stream, *table, fresh, text.m_allow_default_identifiers, target, record);
+                if (stream.pos() < target) {
+                    next = count; // the end of the text
+                } else if (stream.pos() == target && stream.column() == tokens[next].column
+                           && text.m_mode_states.intern(stream.modes()) == text.m_states[next]) {
+                    break;
+                }
+                for (; next < count && shifted(tokens[next].offset) <= stream.pos(); ++next);
+            }
+            if (next == count) {
+                lex(stream, *table, fresh, text.m_allow_default_identifiers, std::string::npos, record);
+            }
+        } catch (...) {
+            source.replace(begin, added, removed_text);
+            throw;
+        }
+
+        // the lines of the old tokens move as much as the line of the first one
+        const size_t line_shift = next < count ? stream.line() - tokens[next].line : 0;
+        for (size_t i = next; i < count; ++i) {
+            tokens[i].offset = shifted(tokens[i].offset);
+            tokens[i].line += line_shift;
+            reaches[i] = shifted(reaches[i]);
+        }
+        tokens.erase(tokens.begin() + first, tokens.begin() + next);
+        tokens.insert(tokens.begin() + first, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+        reaches.erase(reaches.begin() + first, reaches.begin() + next);
+        reaches.insert(reaches.begin() + first, fresh_reaches.begin(), fresh_reaches.end());
+        text.m_states.erase(text.m_states.begin() + first, text.m_states.begin() + next);
+        text.m_states.insert(text.m_states.begin() + first, fresh_states.begin(), fresh_states.end());
+        return {first, first + fresh.size()};
+    }
+
+    // tokenize the string, and record a snapshot every snapshots.interval() lines (see tokenize_lines)
+    std::vector<TokenInfo> tokenize(const std::string& str, LexerSnapshots& snapshots,
+                                    bool allow_default_identifiers = true) const {
+        snapshots.m_text = str;
+        FileTokenStream::normalize(snapshots.m_text);
+        snapshots.m_allow_default_identifiers = allow_default_identifiers;
+
+        std::vector<TokenInfo> tokens;
+        std::vector<size_t> ends;
+        std::vector<uint32_t> states;
+        detail::ModeStates mode_states;
+        FileTokenStream stream = FileTokenStream::borrow(snapshots.m_text);
+        lex(stream, *dispatch_table(), tokens, allow_default_identifiers, std::string::npos,
+            {nullptr, nullptr, &ends, &states, &mode_states});
+        snapshots.record(tokens, ends, states, mode_states, stream);
+        return tokens;
+    }
+
+    // returns the tokens that are on the lines [first_line, end_line) of the text of the snapshots
+    // Lexing starts from the nearest snapshot before first_line, so the time depends on the
+    // amount of lines (and on the interval of the snapshots) rather than on the size of the text.
+    std::vector<TokenInfo> tokenize_lines(const LexerSnapshots& snapshots, size_t first_line, size_t end_line) const {
+        std::vector<TokenInfo> tokens;
+        if (first_line >= end_line || snapshots.size() == 0) {
+            return tokens;
+        }
+        const LexerSnapshot& start = snapshots.before_line(first_line);
+        const std::string& text = snapshots.m_text;
+
+        // the tokens that start on end_line or after it are not needed
+        size_t stop_at = start.offset;
+        size_t line = start.line;
+        for (; line < end_line && stop_at < text.size(); ++line) {
+            const void* newline = std::memchr(text.data() + stop_at, '\n', text.size() - stop_at);
+            stop_at = newline == nullptr ? text.size() : static_cast<size_t>(static_cast<const char*>(newline) - text.data()) + 1;
+        }
+        if (line < end_line) {
+            stop_at = std::string::npos;
+        }
+
+        std::vector<size_t> ends;
+        FileTokenStream stream = FileTokenStream::borrow(text);
+        stream.seek(start.offset, start.line, start.column);
+        stream.set_modes(start.modes);
+        lex(stream, *dispatch_table(), tokens, snapshots.m_allow_default_identifiers, stop_at, {nullptr, nullptr, &ends});
+
+        // the tokens that end before first_line
+        size_t before = 0;
+        for (; before < tokens.size() && snapshots.last_line(tokens[before], ends[before]) < first_line; ++before);
+        tokens.erase(tokens.begin(), tokens.begin() + static_cast<std::ptrdiff_t>(before));
+        return tokens;
+    }
+
+    // tokenize the stream from its current position until its end, or until a token would start at or after stop_at
+    // The tokens are appended, and the stream is left where lexing stopped so that it can be resumed
+    void tokenize_stream(FileTokenStream& stream, std::vector<TokenInfo>& tokens,
+                         bool allow_default_identifiers = true, size_t stop_at = std::string::npos) const {
+        lex(stream, *dispatch_table(), tokens, allow_default_identifiers, stop_at);
+    }
+
+    // tokenize many documents on a thread pool
+    // The sink is called once per document with its index in inputs, from the threads of the pool
+    // Small documents are grouped in batches to amortize the scheduling and every worker reuses
+    // its own TokenizerContext, large documents are split with tokenize_parallel.
+    // An error in a document is given to the sink and does not stop the others.
+    void tokenize_many(const std::string* inputs, size_t count, const DocumentSink& sink,
+                       bool allow_default_identifiers = true,
+                       const BatchTokenizeOptions& options = BatchTokenizeOptions()) const {
+        std::unique_ptr<ThreadPool> owned_pool;
+        ThreadPool* pool = options.pool;
+        if (pool == nullptr) {
+            owned_pool = std::make_unique<ThreadPool>();
+            pool = owned_pool.get();
+        }
+
+        // the large documents come first so that they start early
+        std::vector<size_t> large;
+        std::vector<std::pair<size_t, size_t>> batches; // [first, last) of the documents in inputs
+        size_t batch_bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (inputs[i].size() >= options.split_size) {
+                large.push_back(i);
+                batch_bytes = options.batch_size; // a batch does not span a large document
+                continue;
+            }
+            if (batches.empty() || batch_bytes >= options.batch_size) {
+                batches.emplace_back(i, i);
+                batch_bytes = 0;
+            }
+            batches.back().second = i + 1;
+            batch_bytes += inputs[i].size() + 1;
+        }
+
+        // one context per worker, and one for the threads outside of the pool
+        std::vector<TokenizerContext> contexts(pool->size() + 1);
+        ParallelTokenizeOptions split_options;
+        split_options.pool = pool;
+
+        pool->parallel_for(large.size() + batches.size(), [&](size_t task) {
+            if (task < large.size()) {
+                const size_t document = large[task];
+                std::vector<TokenInfo> tokens;
+                std::exception_ptr error;
+                try {
+                    tokens = tokenize_parallel(inputs[document], allow_default_identifiers, split_options);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                sink(document, tokens, error);
+                return;
+            }
+
+            auto& context = contexts[pool->worker_index()];
+            const auto& batch = batches[task - large.size()];
+            for (size_t document = batch.first; document < batch.second; ++document) {
+                std::exception_ptr error;
+                try {
+                    tokenize(inputs[document], context, allow_default_identifiers);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                sink(document, context.tokens, error);
+            }
+        });
+    }
+
+    // tokenize many documents on a thread pool (see above)
+    void tokenize_many(const std::vector<std::string>& inputs, const DocumentSink& sink,
+                       bool allow_default_identifiers = true,
+                       const BatchTokenizeOptions& options = BatchTokenizeOptions()) const {
+        tokenize_many(inputs.data(), inputs.size(), sink, allow_default_identifiers, options);
+    }
+
+    // tokenize a string on several threads
+    // The string is cut in chunks right after a newline, and each chunk is lexed
+    // speculatively as if a token started at its beginning. The chunks are then
+    // stitched in order: a chunk is kept from the first token start that the
+    // previous chunk also reached, and is lexed again from the real state when
+    // there is none (for example when it began inside a TokenBeginEndPair).
+    // The result (and the exception thrown, if any) is the same as tokenize,
+    // as long as the registered parsers can be called from several threads at once.
+    std::vector<TokenInfo> tokenize_parallel(const std::string& str, bool allow_default_identifiers = true,
+                                             const ParallelTokenizeOptions& options = ParallelTokenizeOptions()) const {
+        std::string normalized;
+        const std::string& source = normalized_source(str, normalized);
+        const size_t chunk_size = std::max<size_t>(1, options.chunk_size);
+
+        // chunk k covers [starts[k], starts[k + 1]), every chunk but the first starts a line
+        std::vector<size_t> starts = { 0 };
+        while (starts.back() + chunk_size < source.size()) {
+            auto newline = source.find('\n', starts.back() + chunk_size);
+            if (newline == std::string::npos || newline + 1 >= source.size()) {
+                break;
+            }
+            starts.push_back(newline + 1);
+        }
+        starts.push_back(source.size());
+        const size_t chunk_count = starts.size() - 1;
+
+        // a chunk can not know the modes it starts in, the input is lexed in one go when there are modes
+        const auto table = dispatch_table();
+        if (chunk_count == 1 || table->modes.size() > 1) {
+            return tokenize(str, allow_default_identifiers);
+        }
+
+        std::unique_ptr<ThreadPool> owned_pool;
+        ThreadPool* pool = options.pool;
+        if (pool == nullptr) {
+            owned_pool = std::make_unique<ThreadPool>();
+            pool = owned_pool.get();
+        }
+
+        StructuralIndex index;
+        if (m_structural_index) {
+            index = StructuralIndex(source, table->classes, pool);
+        }
+        auto make_stream = [&]() {
+            auto stream = FileTokenStream::borrow(source);
+            if (m_structural_index) {
+                stream.set_index(&index);
+            }
+            return stream;
+        };
+
+        // the line each chunk starts at is the prefix sum of the newlines of the previous chunks
+        std::vector<size_t> lines(chunk_count, 0);
+        pool->parallel_for(chunk_count, [&](size_t k) {
+            lines[k] = std::count(source.begin() + starts[k], source.begin() + starts[k + 1], '\n');
+        });
+        for (size_t k = 0, line = 0; k < chunk_count; ++k) {
+            std::swap(lines[k], line);
+            line += lines[k];
+        }
+
+        struct ChunkResult {
+            std::vector<TokenInfo> tokens;
+            // <token start, amount of tokens emitted before it>
+            std::vector<std::pair<size_t, size_t>> boundaries;
+            // where the chunk stopped
+            size_t end_pos = 0, end_line = 0, end_column = 0;
+            std::exception_ptr error;
+        };
+        std::vector<ChunkResult> chunks(chunk_count);
+
+        pool->parallel_for(chunk_count, [&](size_t k) {
+            auto& chunk = chunks[k];
+            auto stream = make_stream();
+            stream.seek(starts[k], lines[k], 0);
+            try {
+                lex(stream, *table, chunk.tokens, allow_default_identifiers, starts[k + 1], {&chunk.boundaries});
+            } catch (...) {
+                chunk.error = std::current_exception();
+            }
+            chunk.end_pos = stream.pos();
+            chunk.end_line = stream.line();
+            chunk.end_column = stream.column();
+        });
+
+        // stitch the chunks
+        std::vector<TokenInfo> tokens = std::move(chunks[0].tokens);
+        if (chunks[0].error) {
+            std::rethrow_exception(chunks[0].error);
+        }
+        size_t pos = chunks[0].end_pos, line = chunks[0].end_line, column = chunks[0].end_column;
+
+        for (size_t k = 1; k < chunk_count && pos < source.size(); ++k) {
+            // the previous chunk already lexed past this one
+            if (pos >= starts[k + 1]) {
+                continue;
+            }
+            auto& chunk = chunks[k];
+            auto sync = std::lower_bound(chunk.boundaries.begin(), chunk.boundaries.end(),
+                                         std::make_pair(pos, size_t(0)));
+
+            if (sync != chunk.boundaries.end() && sync->first == pos) {
+                tokens.insert(tokens.end(),
+                              std::make_move_iterator(chunk.tokens.begin() + sync->second),
+                              std::make_move_iterator(chunk.tokens.end()));
+                if (chunk.error) {
+                    std::rethrow_exception(chunk.error);
+                }
+                pos = chunk.end_pos;
+                line = chunk.end_line;
+                column = chunk.end_column;
+                continue;
+            }
+
+            // the speculation was wrong, lex the chunk again from the real state
+            auto stream = make_stream();
+            stream.seek(pos, line, column);
+            lex(stream, *table, tokens, allow_default_identifiers, starts[k + 1]);
+            pos = stream.pos();
+            line = stream.line();
+            column = stream.column();
+        }
+        return tokens;
+    }
+
+    // returns the callbacks for each token parser
+    const std::unordered_map<const char *, ParserCallback>& callbacks() const {
+        return m_callbacks;
+    }
+
+private:
+    // returns the string itself when it is already normalized, or a normalized copy stored in storage
+    static const std::string& normalized_source(const std::string& str, std::string& storage) {
+        if (FileTokenStream::is_normalized(str)) {
+            return str;
+        }
+        TOKS_ALLOCATION_SCOPE(StreamCopy);
+        storage = str;
+        FileTokenStream::normalize(storage);
+        return storage;
+    }
+
+    // returns the dispatch table, compiling it if needed
+    std::shared_ptr<const DispatchTable> dispatch_table() const {
+        auto table = std::atomic_load(&m_dispatch);
+        if (table != nullptr) {
+            return table;
+        }
+
+        auto compiled = std::make_shared<DispatchTable>();
+        // the modes are numbered in the order they appear
+        compiled->mode_names.push_back("");
+        auto mode_id = [&](const std::string& name) {
+            auto found = std::find(compiled->mode_names.begin(), compiled->mode_names.end(), name);
+            if (found == compiled->mode_names.end()) {
+                compiled->mode_names.push_back(name);
+                return static_cast<uint32_t>(compiled->mode_names.size() - 1);
+            }
+            return static_cast<uint32_t>(found - compiled->mode_names.begin());
+        };
+        std::vector<uint32_t> parser_modes(m_representations.size());
+        std::vector<std::bitset<256>> starts(m_representations.size());
+        for (size_t i = 0; i < m_representations.size(); ++i) {
+            auto& rep = m_representations[i];
+            compiled->callbacks.push_back(&m_callbacks.at(rep->parser_type()));
+            parser_modes[i] = mode_id(rep->mode());
+            if (rep->pops_mode()) {
+                compiled->transitions.push_back(DispatchTable::pop);
+            } else if (rep->pushes_mode()) {
+                compiled->transitions.push_back(static_cast<int32_t>(mode_id(rep->pushed_mode())));
+            } else {
+                compiled->transitions.push_back(DispatchTable::stay);
+            }
+            rep->start_bytes(starts[i]);
+            compiled->classes.start |= starts[i];
+
+            if (auto pair = dynamic_cast<const TokenBeginEndPair *>(rep.get())) {
+                if (!pair->end().empty()) {
+                    compiled->classes.delimiter.set(static_cast<unsigned char>(pair->end()[0]));
+                }
+                if (pair->begin() == pair->end() && pair->begin().size() == 1) {
+                    compiled->classes.quote.set(static_cast<unsigned char>(pair->begin()[0]));
+                }
+            }
+        }
+        compiled->modes.resize(compiled->mode_names.size());
+        for (uint32_t m = 0; m < compiled->modes.size(); ++m) {
+            auto& mode = compiled->modes[m];
+            mode.offsets.resize(257, 0);
+            for (unsigned c = 0; c < 256; ++c) {
+                mode.offsets[c] = static_cast<uint32_t>(mode.candidates.size());
+                for (size_t i = 0; i < starts.size(); ++i) {
+                    if (parser_modes[i] == m && starts[i][c]) {
+                        mode.candidates.push_back(static_cast<uint32_t>(i));
+                    }
+                }
+            }
+            mode.offsets[256] = static_cast<uint32_t>(mode.candidates.size());
+        }
+
+        table = std::move(compiled);
+        std::atomic_store(&m_dispatch, table);
+        return table;
+    }
+
+    // lexes the normalized source a slice at a time, appending to tokens, and calls the sink after
+    // every slice (which may take the tokens out), the sink returns false to stop
+    template<typename Sink>
+    void lex_slices(const std::string& source, bool allow_default_identifiers, std::vector<TokenInfo>& tokens,
+                    const detail::LexRecord& record, Sink&& sink) const {
+        // the bytes lexed at once
+        static constexpr size_t slice = 1 << 20;
+
+        const auto table = dispatch_table();
+        auto stream = FileTokenStream::borrow(source);
+        StructuralIndex index;
+        if (m_structural_index) {
+            index.build(source, table->classes);
+            stream.set_index(&index);
+        }
+        while (!stream.eof()) {
+            lex(stream, *table, tokens, allow_default_identifiers, stream.pos() + slice, record);
+            if (!sink()) {
+                return;
+            }
+        }
+    }
+
+    // lexes the stream until its end, or until a token would start at or after stop_at
+    template<typename Trace = NoTrace>
+    void lex(FileTokenStream& stream, const DispatchTable& table,
+             std::vector<TokenInfo>& tokens, bool allow_default_identifiers,
+             size_t stop_at = std::string::npos, const detail::LexRecord& record = detail::LexRecord(),
+             Trace&& trace = Trace()) const {
+        const StructuralIndex* index = stream.index();
+        auto* boundaries = record.boundaries;
+        auto* reaches = record.reaches;
+        auto* ends = record.ends;
+        auto* states = record.states;
+        auto* profile = record.profile;
+        const size_t start_pos = stream.pos();
+        const size_t start_tokens = tokens.size();
+        const size_t start_regex_searches = stream.regex_searches();
+        const uint64_t start_ticks = profile != nullptr ? ParserProfile::now() : 0;
+        size_t default_identifiers = 0;
+        TOKS_PROBE2(tokenize__start, stream.str().data() + stream.pos(), stream.size() - stream.pos());
+#if defined(TOKS_HAS_USDT)
+        size_t missed = 0; // the parser attempts that failed in a row
+#endif
+        if (profile != nullptr && profile->parsers.size() < m_representations.size()) {
+            profile->parsers.resize(m_representations.size());
+        }
+
+        // the parsers of the current mode, and the amount of mode changes so far
+        const DispatchTable::Mode* mode = nullptr;
+        auto enter_mode = [&]() {
+            mode = &table.modes[stream.mode() < table.modes.size() ? stream.mode() : 0];
+        };
+        enter_mode();
+        size_t mode_changes = 0;
+
+        // only the parsers that may start with the current byte are tried (in registration order)
+        auto try_parsers = [&]() -> bool {
+            const unsigned char c = stream.peek();
+            const size_t offset = stream.pos();
+            for (uint32_t i = mode->offsets[c]; i < mode->offsets[c + 1]; ++i) {
+                const uint32_t parser = mode->candidates[i];
+                auto call = [&]() {
+                    TOKS_ALLOCATION_SCOPE(TokenValues);
+                    return (*table.callbacks[parser])(stream, *m_representations[parser]);
+                };
+                auto token = profile == nullptr ? call() : profile->attempt(parser, stream, call);
+                trace.parser_attempted(parser, offset, token != nullptr);
+#if defined(TOKS_HAS_USDT)
+                if (token == nullptr && ++missed == TOKS_MISS_STORM) {
+                    TOKS_PROBE2(miss__storm, offset, missed);
+                    missed = 0;
+                } else if (token != nullptr) {
+                    missed = 0;
+                }
+#endif
+                if (token != nullptr) {
+                    token->offset = offset;
+                    {
+                        TOKS_ALLOCATION_SCOPE(TokenVector);
+                        tokens.push_back(std::move(*token));
+                    }
+                    const int32_t transition = table.transitions[parser];
+                    if (transition != DispatchTable::stay) {
+                        if (transition == DispatchTable::pop) {
+                            if (!stream.modes().empty()) {
+                                trace.mode_popped(stream.mode(), offset);
+                            }
+                            stream.pop_mode();
+                        } else {
+                            trace.mode_pushed(static_cast<uint32_t>(transition), offset);
+                            stream.push_mode(static_cast<uint32_t>(transition));
+                        }
+                        enter_mode();
+                        ++mode_changes;
+                    }
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        // returns the amount of characters from the current one to the next whitespace
+        // or the next position where a parser may start
+        auto length_to_stop = [&]() -> size_t {
+            if (index != nullptr) {
+                const size_t end = index->next_stop(stream.pos() + 1);
+                stream.looked_at(end + 1);
+                return end - stream.pos();
+            }
+            const std::string& str = stream.str();
+            size_t end = stream.pos() + 1;
+            for (; end < str.size() && !FileTokenStream::is_whitespace_char(str[end])
+                   && mode->no_candidate(static_cast<unsigned char>(str[end])); ++end);
+            stream.looked_at(end + 1);
+            return end - stream.pos();
+        };
+
+        // in a partial stream, the token that depends on the end of the string is undone
+        // and the stream is left before it (it is lexed again once more bytes follow)
+        size_t resume_pos = stream.pos(), resume_line = stream.line(), resume_column = stream.column();
+        size_t resume_tokens = tokens.size();
+        std::vector<uint32_t> resume_modes = stream.modes();
+        size_t resume_mode_changes = 0;
+        auto suspended = [&]() -> bool {
+            if (!stream.partial() || !stream.touched_end()) {
+                return false;
+            }
+            stream.seek(resume_pos, resume_line, resume_column);
+            tokens.erase(tokens.begin() + resume_tokens, tokens.end());
+            if (mode_changes != resume_mode_changes) {
+                stream.set_modes(resume_modes);
+                enter_mode();
+            }
+            return true;
+        };
+        stream.clear_reach();
+        uint32_t state = states != nullptr ? record.mode_states->intern(stream.modes()) : 0;
+        size_t state_mode_changes = 0;
+        // the tokens are traced once they can no longer be undone
+        size_t traced = tokens.size();
+        auto trace_tokens = [&]() {
+            for (; traced < tokens.size(); ++traced) {
+                trace.token_emitted(tokens[traced]);
+                TOKS_PROBE3(token__emit, tokens[traced].offset, tokens[traced].value.size(), tokens[traced].token_type);
+            }
+        };
+
+        while (true) {
+            if (reaches != nullptr) {
+                reaches->resize(tokens.size(), stream.reach());
+            }
+            if (ends != nullptr) {
+                // (an identifier found before a parser in the same iteration ends where the parser starts)
+                for (size_t i = ends->size(); i < tokens.size(); ++i) {
+                    ends->push_back(i + 1 < tokens.size() ? tokens[i + 1].offset : stream.pos());
+                }
+            }
+            if (states != nullptr) {
+                states->resize(tokens.size(), state);
+            }
+            if (suspended() || stream.eof()) {
+                break;
+            }
+            trace_tokens();
+            if (stream.partial()) {
+                resume_pos = stream.pos();
+                resume_line = stream.line();
+                resume_column = stream.column();
+                resume_tokens = tokens.size();
+                if (mode_changes != resume_mode_changes) {
+                    resume_modes = stream.modes();
+                    resume_mode_changes = mode_changes;
+                }
+            }
+            if (states != nullptr && mode_changes != state_mode_changes) {
+                state = record.mode_states->intern(stream.modes());
+                state_mode_changes = mode_changes;
+            }
+            stream.clear_reach();
+
+            stream.skip_whitespace();
+
+            if (stream.eof() || stream.pos() >= stop_at) {
+                break;
+            }
+            if (boundaries != nullptr) {
+                boundaries->emplace_back(stream.pos(), tokens.size());
+            }
+
+            if (try_parsers()) {
+                continue;
+            }
+
+            if (!allow_default_identifiers) {
+                if (suspended()) {
+                    break;
+                }
+                trace_tokens();
+                trace.error(stream.line(), stream.column());
+                throw TokenizerError(stream.line(), stream.column());
+            }
+
+            auto token = make_parser_callback_result(m_default_type, "", stream.line(), stream.column());
+            token->offset = stream.pos();
+
+            // parse the default identifier as a word
+            if (m_default_as_words) {
+                const size_t length = stream.word_length();
+                if (suspended()) {
+                    break; // the word may go on
+                }
+                {
+                    TOKS_ALLOCATION_SCOPE(TokenValues);
+                    token->value.assign(stream.str(), stream.pos(), length);
+                }
+                stream.next(length);
+                {
+                    TOKS_ALLOCATION_SCOPE(TokenVector);
+                    tokens.push_back(std::move(*token));
+                }
+                ++default_identifiers;
+                continue;
+            }
+
+            // parse the default identifier as a sequence of characters until a parser matches
+            // (the characters no parser may start with are taken at once)
+            while (!stream.eof() && !stream.is_whitespace()) {
+                const size_t length = length_to_stop();
+                {
+                    TOKS_ALLOCATION_SCOPE(TokenValues);
+                    token->value.append(stream.str(), stream.pos(), length);
+                }
+                stream.next(length);
+
+                if (try_parsers()) {
+                    TOKS_ALLOCATION_SCOPE(TokenVector);
+                    tokens.insert(tokens.end() - 1, std::move(*token)); // insert the identifier before the token that was found
+                    ++default_identifiers;
+                    token = nullptr;
+                    break;
+                }
+            }
+
+            if (token != nullptr) {
+                if (token->value.empty()) {
+                    if (suspended()) {
+                        break;
+                    }
+                    trace_tokens();
+                    trace.error(stream.line(), stream.column());
+                    throw TokenizerError(stream.line(), stream.column());
+                } else {
+                    TOKS_ALLOCATION_SCOPE(TokenVector);
+                    tokens.push_back(std::move(*token));
+                    ++default_identifiers;
+                }
+            }
+        }
+        if (reaches != nullptr) {
+            reaches->resize(tokens.size(), stream.reach());
+        }
+        if (ends != nullptr) {
+            for (size_t i = ends->size(); i < tokens.size(); ++i) {
+                ends->push_back(i + 1 < tokens.size() ? tokens[i + 1].offset : stream.pos());
+            }
+        }
+        if (states != nullptr) {
+            states->resize(tokens.size(), state);
+        }
+        trace_tokens();
+        TOKS_PROBE2(tokenize__end, stream.pos() - start_pos, tokens.size() - start_tokens);
+        if (profile != nullptr) {
+            ++profile->calls;
+            profile->bytes += stream.pos() - start_pos;
+            profile->tokens += tokens.size() - start_tokens;
+            profile->default_identifiers += default_identifiers;
+            profile->regex_searches += stream.regex_searches() - start_regex_searches;
+            profile->ticks += ParserProfile::now() - start_ticks;
+        }
+    }
+
+};
+
+inline std::string ParserProfile::report(const Tokenizer& tokenizer) const {
+    std::vector<size_t> order(parsers.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return parsers[a].ticks > parsers[b].ticks;
+    });
+
+    auto percent = [](uint64_t part, uint64_t total) {
+        return total == 0 ? 0.0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+    };
+    char line[256];
+    std::string out;
+    snprintf(line, sizeof(line), "%llu calls, %llu bytes, %llu tokens, %llu default identifiers, "
+             "%llu regex searches, %llu ticks\n", static_cast<unsigned long long>(calls),
+             static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(tokens),
+             static_cast<unsigned long long>(default_identifiers), static_cast<unsigned long long>(regex_searches),
+             static_cast<unsigned long long>(ticks));
+    out += line;
+    snprintf(line, sizeof(line), "%6s %12s %12s %12s %14s %7s  %s\n", "parser", "attempts", "hits", "misses",
+             "bytes", "time %", "type: what");
+    out += line;
+    for (size_t i : order) {
+        const auto& counters = parsers[i];
+        if (counters.attempts == 0) {
+            continue;
+        }
+        std::string what;
+        if (i < tokenizer.parsers().size()) {
+            what = std::string(tokenizer.parsers()[i]->token_type()) + ": " + tokenizer.parsers()[i]->describe();
+        }
+        snprintf(line, sizeof(line), "%6zu %12llu %12llu %12llu %14llu %7.2f  ", i,
+                 static_cast<unsigned long long>(counters.attempts), static_cast<unsigned long long>(counters.hits),
+                 static_cast<unsigned long long>(counters.misses()), static_cast<unsigned long long>(counters.bytes),
+                 percent(counters.ticks, ticks));
+        out += line;
+        out += what;
+        out += '\n';
+    }
+    return out;
+}
+
+inline GrammarReport Tokenizer::analyze() const {
+    GrammarReport report;
+    auto name = [&](size_t i) {
+        return "parser " + std::to_string(i) + " (" + m_representations[i]->token_type() + ": "
+               + m_representations[i]->describe() + ")";
+    };
+    // the string a parser always starts with, if it is a keyword or a pair
+    auto literal = [&](size_t i, const std::string *&out) -> bool {
+        if (auto keyword = dynamic_cast<const TokenKeyword *>(m_representations[i].get())) {
+            out = &keyword->keyword();
+            return true;
+        }
+        if (auto pair = dynamic_cast<const TokenBeginEndPair *>(m_representations[i].get())) {
+            out = &pair->begin();
+            return true;
+        }
+        return false;
+    };
+    auto starts_with = [](const std::string& str, const std::string& prefix) {
+        return str.compare(0, prefix.size(), prefix) == 0;
+    };
+
+    for (size_t i = 0; i < m_representations.size(); ++i) {
+        const TokenParser& parser = *m_representations[i];
+        const std::string *text = nullptr;
+
+        if (literal(i, text)) {
+            // the first earlier keyword of the same mode that the text starts with always matches before it
+            for (size_t j = 0; j < i; ++j) {
+                auto keyword = dynamic_cast<const TokenKeyword *>(m_representations[j].get());
+                if (keyword != nullptr && keyword->mode() == parser.mode() && starts_with(*text, keyword->keyword())) {
+                    report.issues.push_back({GrammarIssue::ShadowedKeyword, i, j,
+                                             name(i) + " is shadowed by the earlier " + name(j)
+                                             + ", register the longer one first"});
+                    break;
+                }
+            }
+        }
+
+        if (auto pair = dynamic_cast<const TokenBeginEndPair *>(&parser)) {
+            // (a pair is only tried after an earlier one whose begin it starts with failed to find its end)
+            for (size_t j = 0; j < i; ++j) {
+                auto earlier = dynamic_cast<const TokenBeginEndPair *>(m_representations[j].get());
+                if (earlier != nullptr && earlier->mode() == parser.mode()
+                    && (starts_with(pair->begin(), earlier->begin()) || starts_with(earlier->begin(), pair->begin()))) {
+                    report.issues.push_back({GrammarIssue::OverlappingBegin, i, j,
+                                             name(i) + " overlaps the begin of the earlier " + name(j)});
+                }
+            }
+        }
+
+        if (auto regex = dynamic_cast<const RegexParser *>(&parser)) {
+            // (the regexes are searched ahead, an empty match anywhere in the probes counts)
+            bool empty = std::regex_match(std::string(), regex->regex());
+            for (const char *probe : { " ", "a", "0", "_", "\n" }) {
+                std::cmatch match;
+                if (!empty && std::regex_search(probe, match, regex->regex())) {
+                    empty = match.length() == 0;
+                }
+            }
+            if (empty) {
+                report.issues.push_back({GrammarIssue::EmptyRegex, i, i,
+                                         name(i) + " can match the empty string, the lexer would not move forward"});
+            }
+        }
+
+        std::bitset<256> bytes;
+        parser.start_bytes(bytes);
+        if (bytes.all()) {
+            ++report.any_byte_parsers;
+        }
+    }
+
+    const auto table = dispatch_table();
+    size_t bytes = 0, candidates = 0;
+    for (size_t m = 0; m < table->modes.size(); ++m) {
+        auto& mode = table->modes[m];
+        for (unsigned c = 0; c < 256; ++c) {
+            const size_t count = mode.offsets[c + 1] - mode.offsets[c];
+            if (count == 0) {
+                continue;
+            }
+            ++bytes;
+            candidates += count;
+            if (count > report.max_candidates) {
+                report.max_candidates = count;
+                report.max_candidates_byte = static_cast<unsigned char>(c);
+                report.max_candidates_mode = table->mode_names[m];
+            }
+        }
+    }
+    report.candidates_per_byte = bytes == 0 ? 0 : static_cast<double>(candidates) / static_cast<double>(bytes);
+    return report;
+}
+
+inline void CombinatorParser::add_parser(std::unique_ptr<TokenParser> &&parser) {
+    m_parsers.push_back(std::move(parser));
+    m_tokenizer_ref.reset_dispatch_table();
+}
+
+ParserCallbackResult CombinatorParser::parser_callback(FileTokenStream& s, TokenParser& parser) {
+    auto& combinator = dynamic_cast<CombinatorParser&>(parser);
+    s.push_state();
+
+    auto token = make_parser_callback_result(combinator.token_type(), "", s.line(), s.column());
+
+    for (auto& p : combinator.parsers()) {
+        auto info = combinator.m_tokenizer_ref.callbacks().at(p->parser_type())(s, *p);
+
+        if (info == nullptr) {
+            s.pop_state();
+            return nullptr;
+        }
+        token->value += info->value;
+    }
+    s.pop_state(false);
+    return token;
+}
+
+namespace detail {
+
+// Waits a bit longer every time: spins first, then yields, then sleeps
+class Backoff {
+private:
+    unsigned m_count = 0;
+
+public:
+    void wait() {
+        ++m_count;
+        if (m_count < 64) {
+#if defined(__SSE2__)
+            _mm_pause();
+#endif
+        } else if (m_count < 1024) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+};
+
+} // namespace detail
+
+// A bounded lock free queue for exactly one producer thread and one consumer thread
+// push waits while the queue is full (backpressure) and pop waits while it is empty.
+// The producer calls close() once it is done, the consumer then drains the queue.
+// Either side can cancel() it to make the other side give up.
+template<typename T>
+class SpscQueue {
+private:
+    std::vector<T> m_slots;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_head{0}; // the next slot to read, written by the consumer
+    alignas(64) std::atomic<size_t> m_tail{0}; // the next slot to write, written by the producer
+    std::atomic<bool> m_closed{false};
+    std::atomic<bool> m_cancelled{false};
+
+public:
+    // create a queue that holds at least capacity values (rounded up to a power of two)
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // returns the amount of values the queue can hold
+    size_t capacity() const {
+        return m_slots.size();
+    }
+
+    // push a value if the queue is not full, the value is left untouched otherwise
+    bool try_push(T&& value) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == m_slots.size()) {
+            return false;
+        }
+        m_slots[tail & m_mask] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop a value if the queue is not empty
+    bool try_pop(T& value) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // push a value, waiting while the queue is full
+    // returns false if the queue was cancelled
+    bool push(T&& value) {
+        for (detail::Backoff backoff; !try_push(std::move(value)); backoff.wait()) {
+            if (m_cancelled.load(std::memory_order_acquire)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // pop a value, waiting while the queue is empty
+    // returns false once the queue is closed and drained, or cancelled
+    bool pop(T& value) {
+        for (detail::Backoff backoff; !try_pop(value); backoff.wait()) {
+            if (m_cancelled.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (m_closed.load(std::memory_order_acquire)) {
+                return try_pop(value);
+            }
+        }
+        return true;
+    }
+
+    // no more values will be pushed
+    void close() {
+        m_closed.store(true, std::memory_order_release);
+    }
+
+    // makes push and pop give up
+    void cancel() {
+        m_cancelled.store(true, std::memory_order_release);
+    }
+};
+
+// Options of TokenPipeline
+struct PipelineOptions {
+    // the amount of values each queue between two stages can hold
+    size_t queue_capacity = 64;
+    // a document is lexed in batches covering about this many bytes
+    size_t batch_bytes = 64 << 10;
+};
+
+// The tokens of a part of a document, as given to the consumer of a TokenPipeline
+struct TokenBatch {
+    size_t document = 0; // the index of the document in read order
+    std::vector<TokenInfo> tokens;
+    bool last = false; // whether this is the last batch of the document
+    std::exception_ptr error; // set on the last batch when reading or lexing the document failed
+};
+
+// Tokenizes a sequence of documents with one thread per stage:
+//
+// read -> normalize -> lex -> consume
+//
+// The stages are connected by bounded SpscQueue so that reading, lexing and
+// consuming overlap, and a slow stage makes the previous ones wait instead of
+// buffering without bounds. The consumer runs on the thread calling run, and the
+// token vectors it is done with are given back to the lexer to be reused.
+class TokenPipeline {
+public:
+    // fills text with the next document, returns false when there are no more documents
+    // An exception thrown by the reader is given to the consumer as the error of that document
+    using Reader = std::function<bool(std::string& text)>;
+    // called for every batch, in order
+    using Consumer = std::function<void(TokenBatch& batch)>;
+
+private:
+    const Tokenizer& m_tokenizer;
+    PipelineOptions m_options;
+
+    struct Document {
+        size_t id = 0;
+        std::string text;
+        std::exception_ptr error;
+    };
+
+public:
+    // the tokenizer must outlive the pipeline
+    explicit TokenPipeline(const Tokenizer& tokenizer, const PipelineOptions& options = PipelineOptions())
+        : m_tokenizer(tokenizer)
+        , m_options(options)
+    {}
+
+    // reads a whole file
+    static std::string read_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // runs the pipeline until the reader has no more documents
+    // An exception thrown by the consumer stops every stage and is rethrown
+    void run(const Reader& reader, const Consumer& consumer, bool allow_default_identifiers = true) {
+        SpscQueue<Document> read(m_options.queue_capacity);
+        SpscQueue<Document> normalized(m_options.queue_capacity);
+        SpscQueue<TokenBatch> batches(m_options.queue_capacity);
+        SpscQueue<std::vector<TokenInfo>> recycled(m_options.queue_capacity);
+
+        std::thread read_thread([&] {
+            for (size_t id = 0;; ++id) {
+                Document document;
+                document.id = id;
+                try {
+                    if (!reader(document.text)) {
+                        break;
+                    }
+                } catch (...) {
+                    document.error = std::current_exception();
+                }
+                if (!read.push(std::move(document))) {
+                    break;
+                }
+            }
+            read.close();
+        });
+
+        std::thread normalize_thread([&] {
+            Document document;
+            while (read.pop(document)) {
+                if (!FileTokenStream::is_normalized(document.text)) {
+                    FileTokenStream::normalize(document.text);
+                }
+                if (!normalized.push(std::move(document))) {
+                    break;
+                }
+            }
+            normalized.close();
+        });
+
+        std::thread lex_thread([&] {
+            Document document;
+            while (normalized.pop(document)) {
+                auto stream = FileTokenStream::borrow(document.text);
+                bool last = false;
+                while (!last) {
+                    TokenBatch batch;
+                    batch.document = document.id;
+                    recycled.try_pop(batch.tokens);
+                    batch.error = document.error;
+                    if (!batch.error) {
+                        try {
+                            m_tokenizer.tokenize_stream(stream, batch.tokens, allow_default_identifiers,
+                                                        stream.pos() + m_options.batch_bytes);
+                        } catch (...) {
+                            batch.error = std::current_exception();
+                        }
+                    }
+                    last = batch.last = batch.error || stream.eof();
+                    if (!batches.push(std::move(batch))) {
+                        return;
+                    }
+                }
+            }
+            batches.close();
+        });
+
+        std::exception_ptr error;
+        TokenBatch batch;
+        try {
+            while (batches.pop(batch)) {
+                consumer(batch);
+                batch.tokens.clear();
+                recycled.try_push(std::move(batch.tokens));
+            }
+        } catch (...) {
+            error = std::current_exception();
+            read.cancel();
+            normalized.cancel();
+            batches.cancel();
+        }
+        read_thread.join();
+        normalize_thread.join();
+        lex_thread.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // runs the pipeline over the given files
+    void run(const std::vector<std::string>& paths, const Consumer& consumer, bool allow_default_identifiers = true) {
+        size_t next = 0;
+        run([&](std::string& text) {
+            if (next == paths.size()) {
+                return false;
+            }
+            text = read_file(paths[next++]);
+            return true;
+        }, consumer, allow_default_identifiers);
+    }
+};
+
+// A pool of string buffers that are given back to it once they are not used anymore
+// This is thread safe
+class BufferPool {
+private:
+    std::mutex m_mutex;
+    std::vector<std::string> m_free;
+    size_t m_max_free;
+
+public:
+    // A buffer taken from a BufferPool, it goes back to the pool when destroyed
+    class Buffer {
+    private:
+        friend class BufferPool;
+
+        BufferPool* m_pool = nullptr;
+        std::string m_data;
+
+        Buffer(BufferPool* pool, std::string&& data)
+            : m_pool(pool)
+            , m_data(std::move(data))
+        {}
+
+    public:
+        Buffer() = default;
+
+        Buffer(Buffer&& other) noexcept
+            : m_pool(other.m_pool)
+            , m_data(std::move(other.m_data))
+        {
+            other.m_pool = nullptr;
+        }
+
+        Buffer& operator=(Buffer&& other) noexcept {
+            if (this != &other) {
+                release();
+                m_pool = other.m_pool;
+                m_data = std::move(other.m_data);
+                other.m_pool = nullptr;
+            }
+            return *this;
+        }
+
+        ~Buffer() {
+            release();
+        }
+
+        // gives the buffer back to its pool now
+        void release() {
+            if (m_pool != nullptr) {
+                m_pool->give_back(std::move(m_data));
+                m_pool = nullptr;
+            }
+            m_data.clear();
+        }
+
+        std::string& str() {
+            return m_data;
+        }
+
+        const std::string& str() const {
+            return m_data;
+        }
+    };
+
+    // the pool keeps at most max_free unused buffers
+    explicit BufferPool(size_t max_free = 256)
+        : m_max_free(max_free)
+    {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // returns a buffer of the given size, reusing the memory of a released buffer when possible
+    Buffer acquire(size_t size) {
+        std::string data;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_free.empty()) {
+                // prefer a buffer that is already large enough
+                auto it = std::find_if(m_free.begin(), m_free.end(), [&](const std::string& free) {
+                    return free.capacity() >= size;
+                });
+                if (it == m_free.end()) {
+                    it = m_free.end() - 1;
+                }
+                data = std::move(*it);
+                *it = std::move(m_free.back());
+                m_free.pop_back();
+            }
+        }
+        data.resize(size);
+        return Buffer(this, std::move(data));
+    }
+
+    // returns the amount of unused buffers
+    size_t free_count() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_free.size();
+    }
+
+private:
+    void give_back(std::string&& data) {
+        data.clear();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.size() < m_max_free) {
+            m_free.push_back(std::move(data));
+        }
+    }
+};
+
+#if defined(TOKS_HAS_IO_URING)
+namespace detail {
+
+// A minimal io_uring ring, driven with the raw system calls
+class IoUring {
+private:
+    int m_fd = -1;
+    unsigned m_entries = 0;
+
+    void *m_sq_ring = MAP_FAILED;
+    void *m_cq_ring = MAP_FAILED;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    io_uring_sqe *m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t m_sqes_size = 0;
+
+    unsigned *m_sq_head = nullptr;
+    unsigned *m_sq_tail = nullptr;
+    unsigned *m_sq_mask = nullptr;
+    unsigned *m_sq_array = nullptr;
+    unsigned *m_cq_head = nullptr;
+    unsigned *m_cq_tail = nullptr;
+    unsigned *m_cq_mask = nullptr;
+    io_uring_cqe *m_cqes = nullptr;
+
+    unsigned m_local_tail = 0; // the prepared but not yet submitted entries end here
+    unsigned m_to_submit = 0;
+    size_t m_in_flight = 0; // the submitted entries whose completion was not seen yet
+
+    template<typename T>
+    static T *at(void *base, unsigned offset) {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0) {
+            return;
+        }
+        m_entries = params.sq_entries;
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        }
+        m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ring == MAP_FAILED) {
+            close_ring();
+            return;
+        }
+        m_cq_ring = single_mmap ? m_sq_ring
+            : mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+        if (m_cq_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+            close_ring();
+            return;
+        }
+        m_sq_head = at<unsigned>(m_sq_ring, params.sq_off.head);
+        m_sq_tail = at<unsigned>(m_sq_ring, params.sq_off.tail);
+        m_sq_mask = at<unsigned>(m_sq_ring, params.sq_off.ring_mask);
+        m_sq_array = at<unsigned>(m_sq_ring, params.sq_off.array);
+        m_cq_head = at<unsigned>(m_cq_ring, params.cq_off.head);
+        m_cq_tail = at<unsigned>(m_cq_ring, params.cq_off.tail);
+        m_cq_mask = at<unsigned>(m_cq_ring, params.cq_off.ring_mask);
+        m_cqes = at<io_uring_cqe>(m_cq_ring, params.cq_off.cqes);
+        m_local_tail = *m_sq_tail;
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        close_ring();
+    }
+
+    // returns true if the ring could be created
+    bool valid() const {
+        return m_fd >= 0;
+    }
+
+    // returns the amount of entries that can be submitted at once
+    unsigned entries() const {
+        return m_entries;
+    }
+
+    // returns true if the kernel supports every given operation
+    bool supports(std::initializer_list<unsigned> operations) const {
+        const size_t count = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+        auto probe = reinterpret_cast<io_uring_probe *>(storage.data());
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, count) < 0) {
+            return false;
+        }
+        for (unsigned operation : operations) {
+            if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // returns a cleared submission entry, or nullptr if the submission queue is full
+    io_uring_sqe *next_entry() {
+        const unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_local_tail - head >= m_entries) {
+            return nullptr;
+        }
+        const unsigned index = m_local_tail & *m_sq_mask;
+        io_uring_sqe *entry = &m_sqes[index];
+        std::memset(entry, 0, sizeof(*entry));
+        m_sq_array[index] = index;
+        ++m_local_tail;
+        ++m_to_submit;
+        return entry;
+    }
+
+    // submits the prepared entries and waits for at least wait_for completions
+    void submit(unsigned wait_for) {
+        __atomic_store_n(m_sq_tail, m_local_tail, __ATOMIC_RELEASE);
+        for (;;) {
+            const long submitted = syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_for,
+                                           wait_for != 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (submitted >= 0) {
+                m_to_submit -= static_cast<unsigned>(submitted);
+                m_in_flight += static_cast<size_t>(submitted);
+                return;
+            }
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    // calls fn(user_data, result) for every available completion
+    template<typename Fn>
+    unsigned complete(Fn&& fn) {
+        unsigned count = 0;
+        unsigned head = *m_cq_head;
+        while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe& completion = m_cqes[head & *m_cq_mask];
+            fn(completion.user_data, completion.res);
+            ++head;
+            ++count;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        m_in_flight -= count;
+        return count;
+    }
+
+    // drops the prepared entries that were not submitted and waits for the completions of the others,
+    // calling fn(user_data, result) for each of them (the memory they use may then be freed)
+    template<typename Fn>
+    void drain(Fn&& fn) {
+        // (without a polling thread the kernel only takes the entries in io_uring_enter)
+        m_local_tail = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(m_sq_tail, m_local_tail, __ATOMIC_RELEASE);
+        m_to_submit = 0;
+        complete(fn);
+        while (m_in_flight != 0) {
+            if (syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // the kernel may still write to the memory of the entries, which can not be freed
+                std::terminate();
+            }
+            complete(fn);
+        }
+    }
+
+private:
+    void close_ring() {
+        if (m_sqes != MAP_FAILED) {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+            munmap(m_cq_ring, m_cq_ring_size);
+        }
+        if (m_sq_ring != MAP_FAILED) {
+            munmap(m_sq_ring, m_sq_ring_size);
+        }
+        m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+        m_cq_ring = m_sq_ring = MAP_FAILED;
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+        m_fd = -1;
+    }
+};
+
+} // namespace detail
+#endif
+
+// Options of FileReader
+struct FileReaderOptions {
+    // the amount of files read at once
+    size_t batch_size = 64;
+    // try io_uring first (Linux only), the pread fallback is used when it is not available
+    bool use_io_uring = true;
+    // the pool of the pread fallback, a temporary pool is created when null
+    ThreadPool* pool = nullptr;
+};
+
+// A file read by FileReader
+struct LoadedFile {
+    size_t index = 0; // the index of the file in the given paths
+    BufferPool::Buffer buffer; // the normalized content of the file
+    std::exception_ptr error; // set if the file could not be read
+
+    // returns a stream reading the buffer without copying it
+    FileTokenStream stream() const {
+        return FileTokenStream::borrow(buffer.str());
+    }
+};
+
+// Reads many files in batches into buffers of a BufferPool
+// On Linux the opens, size queries, reads and closes of a batch are submitted
+// together through io_uring, elsewhere (or when io_uring is not available, or
+// once it failed) the files of a batch are read with pread on a thread pool.
+// The content of the files is normalized in place so that FileTokenStream::borrow
+// can read it without copying it.
+class FileReader {
+public:
+    // called for every file in order, on the thread calling read
+    // The buffer goes back to the pool after the call unless it is moved away
+    using Callback = std::function<void(LoadedFile& file)>;
+
+private:
+    BufferPool& m_buffers;
+    FileReaderOptions m_options;
+#if defined(TOKS_HAS_IO_URING)
+    std::unique_ptr<detail::IoUring> m_ring;
+#endif
+
+    static std::exception_ptr make_error(int error, const std::string& path) {
+        return std::make_exception_ptr(std::system_error(error, std::generic_category(), "Could not read " + path));
+    }
+
+#if defined(TOKS_HAS_IO_URING)
+    // reads the batch through io_uring
+    // returns false if the ring failed, the files are then left unread
+    bool read_batch_io_uring(const std::string *paths, std::vector<LoadedFile>& files) {
+        auto& ring = *m_ring;
+        const size_t count = files.size();
+        std::vector<int> fds(count, -1);
+        std::vector<struct statx> stats(count);
+        std::vector<size_t> done(count, 0);
+
+        auto fail = [&](size_t i, int result) {
+            if (!files[i].error) {
+                files[i].error = make_error(-result, paths[i]);
+            }
+        };
+        auto next_entry = [&]() {
+            auto entry = ring.next_entry();
+            if (entry == nullptr) {
+                throw std::runtime_error("The io_uring submission queue is full");
+            }
+            return entry;
+        };
+        // the opened files are known even when the completions are drained after an error
+        std::function<void(size_t, int)> on_completion = [](size_t, int) {};
+        auto wait_all = [&](size_t expected) {
+            ring.submit(static_cast<unsigned>(expected));
+            size_t completed = 0;
+            while (completed < expected) {
+                completed += ring.complete([&](uint64_t user_data, int result) {
+                    on_completion(static_cast<size_t>(user_data), result);
+                });
+                if (completed < expected) {
+                    ring.submit(1);
+                }
+            }
+        };
+
+        try {
+            // open the files
+            for (size_t i = 0; i < count; ++i) {
+                auto open = next_entry();
+                open->opcode = IORING_OP_OPENAT;
+                open->fd = AT_FDCWD;
+                open->addr = reinterpret_cast<uint64_t>(paths[i].c_str());
+                open->open_flags = O_RDONLY | O_CLOEXEC;
+                open->user_data = i;
+            }
+            on_completion = [&](size_t i, int result) {
+                if (result < 0) {
+                    fail(i, result);
+                } else {
+                    fds[i] = result;
+                }
+            };
+            wait_all(count);
+
+            // query the sizes of the opened files (not of their paths, that may have been replaced since)
+            size_t opened = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (fds[i] < 0) {
+                    continue;
+                }
+                auto stat = next_entry();
+                stat->opcode = IORING_OP_STATX;
+                stat->fd = fds[i];
+                stat->addr = reinterpret_cast<uint64_t>("");
+                stat->statx_flags = AT_EMPTY_PATH;
+                stat->len = STATX_SIZE;
+                stat->off = reinterpret_cast<uint64_t>(&stats[i]);
+                stat->user_data = i;
+                ++opened;
+            }
+            on_completion = [&](size_t i, int result) {
+                if (result < 0) {
+                    fail(i, result);
+                }
+            };
+            wait_all(opened);
+
+            // read them, submitting the rest of the short reads again
+            for (size_t i = 0; i < count; ++i) {
+                if (!files[i].error) {
+                    files[i].buffer = m_buffers.acquire(static_cast<size_t>(stats[i].stx_size));
+                }
+            }
+            on_completion = [&](size_t i, int result) {
+                if (result < 0) {
+                    fail(i, result);
+                } else if (result == 0) {
+                    files[i].buffer.str().resize(done[i]); // the file was truncated
+                } else {
+                    done[i] += static_cast<size_t>(result);
+                }
+            };
+            for (;;) {
+                size_t pending = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    auto& data = files[i].buffer.str();
+                    if (files[i].error || done[i] == data.size()) {
+                        continue;
+                    }
+                    auto read = next_entry();
+                    read->opcode = IORING_OP_READ;
+                    read->fd = fds[i];
+                    read->addr = reinterpret_cast<uint64_t>(&data[done[i]]);
+                    read->len = static_cast<uint32_t>(std::min<size_t>(data.size() - done[i], 1u << 30));
+                    read->off = done[i];
+                    read->user_data = i;
+                    ++pending;
+                }
+                if (pending == 0) {
+                    break;
+                }
+                wait_all(pending);
+            }
+
+            // close them
+            size_t closing = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (fds[i] >= 0) {
+                    auto close = next_entry();
+                    close->opcode = IORING_OP_CLOSE;
+                    close->fd = fds[i];
+                    close->user_data = i;
+                    ++closing;
+                }
+            }
+            on_completion = [&](size_t i, int) {
+                fds[i] = -1;
+            };
+            wait_all(closing);
+            return true;
+        } catch (...) {
+            // the kernel must be done with the buffers before they are freed, and no file may stay open
+            ring.drain([&](uint64_t user_data, int result) {
+                on_completion(static_cast<size_t>(user_data), result);
+            });
+            for (size_t i = 0; i < count; ++i) {
+                if (fds[i] >= 0) {
+                    ::close(fds[i]);
+                }
+                files[i].buffer.release();
+                files[i].error = nullptr;
+            }
+            return false;
+        }
+    }
+#endif
+
+    // reads one file with the plain system calls
+    void read_file(const std::string& path, LoadedFile& file) {
+#if defined(TOKS_HAS_POSIX_IO)
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            file.error = make_error(errno, path);
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            file.error = make_error(errno, path);
+            ::close(fd);
+            return;
+        }
+        file.buffer = m_buffers.acquire(static_cast<size_t>(info.st_size));
+        auto& data = file.buffer.str();
+        size_t done = 0;
+        while (done < data.size()) {
+            const ssize_t result = pread(fd, &data[done], data.size() - done, static_cast<off_t>(done));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                file.error = make_error(errno, path);
+                break;
+            }
+            if (result == 0) {
+                data.resize(done); // the file was truncated
+                break;
+            }
+            done += static_cast<size_t>(result);
+        }
+        ::close(fd);
+#else
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream) {
+            file.error = std::make_exception_ptr(std::runtime_error("Could not read " + path));
+            return;
+        }
+        stream.seekg(0, std::ios::end);
+        file.buffer = m_buffers.acquire(static_cast<size_t>(stream.tellg()));
+        stream.seekg(0, std::ios::beg);
+        stream.read(&file.buffer.str()[0], static_cast<std::streamsize>(file.buffer.str().size()));
+        file.buffer.str().resize(static_cast<size_t>(stream.gcount()));
+#endif
+    }
+
+public:
+    // the buffers are taken from the given pool, which must outlive the reader
+    explicit FileReader(BufferPool& buffers, const FileReaderOptions& options = FileReaderOptions())
+        : m_buffers(buffers)
+        , m_options(options)
+    {
+        m_options.batch_size = std::max<size_t>(1, m_options.batch_size);
+#if defined(TOKS_HAS_IO_URING)
+        if (m_options.use_io_uring) {
+            // one entry per file to open, query the size, read or close a batch at once
+            m_ring = std::make_unique<detail::IoUring>(static_cast<unsigned>(m_options.batch_size));
+            if (!m_ring->valid() || m_ring->entries() < m_options.batch_size
+                || !m_ring->supports({ IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE })) {
+                m_ring.reset();
+            }
+        }
+#endif
+    }
+
+    // returns true if the files are read through io_uring
+    bool uses_io_uring() const {
+#if defined(TOKS_HAS_IO_URING)
+        return m_ring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    // reads the files and calls the callback for each of them, in order
+    void read(const std::vector<std::string>& paths, const Callback& callback) {
+        std::unique_ptr<ThreadPool> owned_pool;
+        ThreadPool* pool = m_options.pool;
+
+        for (size_t first = 0; first < paths.size(); first += m_options.batch_size) {
+            std::vector<LoadedFile> files(std::min(m_options.batch_size, paths.size() - first));
+            for (size_t i = 0; i < files.size(); ++i) {
+                files[i].index = first + i;
+            }
+
+#if defined(TOKS_HAS_IO_URING)
+            if (m_ring != nullptr && !read_batch_io_uring(paths.data() + first, files)) {
+                // the ring failed, this batch and the next ones are read with pread
+                m_ring.reset();
+            }
+#endif
+            if (!uses_io_uring()) {
+                if (pool == nullptr) {
+                    owned_pool = std::make_unique<ThreadPool>();
+                    pool = owned_pool.get();
+                }
+                pool->parallel_for(files.size(), [&](size_t i) {
+                    read_file(paths[first + i], files[i]);
+                });
+            }
+
+            for (auto& file : files) {
+                if (file.error) {
+                    file.buffer.release();
+                } else {
+                    FileTokenStream::normalize(file.buffer.str());
+                }
+                callback(file);
+            }
+        }
+    }
+};
+
+// Lexes an input that arrives in chunks (from a socket, a pipe, ...)
+// Every call to feed returns the tokens that are certain with the bytes received so far:
+// a token that may still change (a word that may go on, a pair that is not closed yet,
+// a keyword that may be the beginning of a longer one, ...) is held back with its bytes
+// until more bytes follow or finish is called. Only those bytes are kept, and the failed
+// scans of the pending token (like the search for the end of a pair) continue where they
+// stopped instead of starting over.
+//
+// The tokens are the ones Tokenizer::tokenize returns for the whole input, provided that
+// the parsers read the stream through its methods (and not through str() or c_str()) and
+// that the regexes do not look further than regex_lookahead bytes past their matches.
+// Note that a regex parser searches ahead for its match (see RegexParser): a position
+// where it does not match stays pending until a match appears or finish is called.
+//
+// After an error, reset must be called before the tokenizer is fed again.
+class StreamingTokenizer {
+private:
+    const Tokenizer& m_tokenizer;
+    bool m_allow_default_identifiers;
+    size_t m_regex_lookahead;
+    std::string m_buffer; // the normalized bytes, the pending ones start at m_start
+    size_t m_start = 0;
+    size_t m_offset = 0; // the offset of m_buffer in the whole input
+    size_t m_line = 0; // the line and column at m_start
+    size_t m_column = 0;
+    std::vector<uint32_t> m_modes; // the lexer modes at m_start
+    detail::ScanMemo m_memo;
+    std::vector<TokenInfo> m_tokens;
+
+    const std::vector<TokenInfo>& lex(bool partial) {
+        m_tokens.clear();
+        FileTokenStream stream = FileTokenStream::borrow(m_buffer);
+        stream.set_partial(partial, m_regex_lookahead, &m_memo, m_offset);
+        stream.seek(m_start, m_line, m_column);
+        stream.set_modes(m_modes);
+        m_tokenizer.tokenize_stream(stream, m_tokens, m_allow_default_identifiers);
+        for (auto& token : m_tokens) {
+            token.offset += m_offset; // the offsets are in the whole input
+        }
+
+        m_start = stream.pos();
+        m_line = stream.line();
+        m_column = stream.column();
+        m_modes = stream.modes();
+        m_memo.drop_before(m_offset + m_start);
+        // the lexed bytes are dropped once they make up half of the buffer
+        if (m_start >= m_buffer.size() - m_start) {
+            m_buffer.erase(0, m_start);
+            m_offset += m_start;
+            m_start = 0;
+        }
+        return m_tokens;
+    }
+
+public:
+    StreamingTokenizer(const Tokenizer& tokenizer, bool allow_default_identifiers = true, size_t regex_lookahead = 1)
+        : m_tokenizer(tokenizer), m_allow_default_identifiers(allow_default_identifiers),
+          m_regex_lookahead(regex_lookahead)
+    {}
+
+    // appends the bytes to the input and returns the tokens that became certain
+    // The returned vector is reused by the next call.
+    const std::vector<TokenInfo>& feed(const char* data, size_t size) {
+        // dropping \r does not depend on the bytes around it, so a chunk is normalized on its own
+        const size_t old_size = m_buffer.size();
+        m_buffer.append(data, size);
+        m_buffer.erase(std::remove(m_buffer.begin() + old_size, m_buffer.end(), '\r'), m_buffer.end());
+        return lex(true);
+    }
+
+    const std::vector<TokenInfo>& feed(const std::string& data) {
+        return feed(data.data(), data.size());
+    }
+
+    // ends the input and returns the remaining tokens
+    // The tokenizer is then ready for a new input.
+    const std::vector<TokenInfo>& finish() {
+        lex(false);
+        m_buffer.clear();
+        m_start = m_offset = m_line = m_column = 0;
+        m_modes.clear();
+        m_memo.clear();
+        return m_tokens;
+    }
+
+    // forgets the current input, the next one starts at the given line and column
+    void reset(size_t line = 0, size_t column = 0) {
+        m_buffer.clear();
+        m_start = m_offset = 0;
+        m_line = line;
+        m_column = column;
+        m_modes.clear();
+        m_memo.clear();
+        m_tokens.clear();
+    }
+
+    // returns the amount of bytes received but not lexed yet
+    size_t pending() const {
+        return m_buffer.size() - m_start;
+    }
+
+    // returns the offset of the first pending byte in the normalized input
+    size_t offset() const {
+        return m_offset + m_start;
+    }
+
+    // returns the line and column of the first pending byte
+    size_t line() const {
+        return m_line;
+    }
+
+    size_t column() const {
+        return m_column;
+    }
+};
+
+#if defined(TOKS_HAS_POSIX_IO)
+
+struct FollowOptions {
+    // the bytes read at once (the memory used does not grow with the file)
+    size_t read_size = 64 << 10;
+    // how long run waits for a change before looking at the file again
+    std::chrono::milliseconds poll_interval{250};
+};
+
+// Where a FileFollower is in its file, to resume it later
+struct FollowPosition {
+    size_t offset = 0; // the offset in the file of the first byte that is not lexed yet
+    size_t line = 0; // its line and column
+    size_t column = 0;
+};
+
+// Tokenizes a file that keeps growing (like tail -f does for a log file)
+// Every poll reads the bytes appended since the last one and gives the tokens that became
+// certain to the callback (see StreamingTokenizer), the lines go on from the previous reads.
+// A new file at the path (rotation by rename) or a shorter file (rotation by truncation) ends
+// the tokens of the old file and starts the new one at line 0. Only a chunk of the file and
+// the bytes of the pending token are held in memory, whatever the size of the file.
+// On Linux, run sleeps on inotify until the directory of the file changes.
+class FileFollower {
+public:
+    using Callback = std::function<void(const std::vector<TokenInfo>& tokens)>;
+
+private:
+    std::string m_path;
+    FollowOptions m_options;
+    StreamingTokenizer m_streaming;
+    FollowPosition m_start; // where the first file is opened
+    int m_fd = -1;
+    dev_t m_device = 0;
+    ino_t m_inode = 0;
+    size_t m_base = 0; // the offset in the file where the streaming tokenizer started
+    size_t m_read_offset = 0; // the offset in the file of the next byte to read
+    size_t m_dropped = 0; // the \r dropped before the first pending byte
+    std::deque<size_t> m_pending_returns; // the normalized offsets of the \r dropped after it
+    std::vector<char> m_chunk;
+    std::atomic<bool> m_stopped{false};
+#if defined(TOKS_HAS_INOTIFY)
+    int m_notify = -1;
+#endif
+
+    bool open(const FollowPosition& position) {
+        m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0) {
+            return false; // not created yet, or between a rename and the new file
+        }
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0) {
+            close();
+            return false;
+        }
+        m_device = st.st_dev;
+        m_inode = st.st_ino;
+        restart(position);
+        return true;
+    }
+
+    void restart(const FollowPosition& position) {
+        m_streaming.reset(position.line, position.column);
+        m_base = m_read_offset = position.offset;
+        m_dropped = 0;
+        m_pending_returns.clear();
+    }
+
+    void close() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    static void emit(const std::vector<TokenInfo>& tokens, const Callback& callback) {
+        if (!tokens.empty()) {
+            callback(tokens);
+        }
+    }
+
+    // feeds the bytes up to the end of the file
+    size_t read_available(const Callback& callback) {
+        size_t total = 0;
+        while (true) {
+            const ssize_t result = ::pread(m_fd, m_chunk.data(), m_chunk.size(), static_cast<off_t>(m_read_offset));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "Could not read " + m_path);
+            }
+            if (result == 0) {
+                return total;
+            }
+            const size_t size = static_cast<size_t>(result);
+
+            // the \r are dropped by the streaming tokenizer, they are counted to map its offsets back to the file
+            size_t normalized = m_streaming.offset() + m_streaming.pending();
+            const char* at = m_chunk.data();
+            const char* end = at + size;
+            while (const char* found = static_cast<const char*>(std::memchr(at, '\r', static_cast<size_t>(end - at)))) {
+                normalized += static_cast<size_t>(found - at);
+                m_pending_returns.push_back(normalized);
+                at = found + 1;
+            }
+
+            emit(m_streaming.feed(m_chunk.data(), size), callback);
+            m_read_offset += size;
+            total += size;
+            while (!m_pending_returns.empty() && m_pending_returns.front() <= m_streaming.offset()) {
+                m_pending_returns.pop_front();
+                ++m_dropped;
+            }
+        }
+    }
+
+    // waits for a change in the directory of the file, or for the poll interval
+    void wait() {
+#if defined(TOKS_HAS_INOTIFY)
+        if (m_notify >= 0) {
+            struct pollfd fd = {m_notify, POLLIN, 0};
+            if (::poll(&fd, 1, static_cast<int>(m_options.poll_interval.count())) > 0) {
+                char events[4096];
+                while (::read(m_notify, events, sizeof(events)) > 0);
+            }
+            return;
+        }
+#endif
+        std::this_thread::sleep_for(m_options.poll_interval);
+    }
+
+public:
+    // follows the file at path from the given position (its beginning by default)
+    // The file does not have to exist yet.
+    FileFollower(const Tokenizer& tokenizer, std::string path, bool allow_default_identifiers = true,
+                 const FollowOptions& options = FollowOptions(), const FollowPosition& start = FollowPosition())
+        : m_path(std::move(path)), m_options(options), m_streaming(tokenizer, allow_default_identifiers),
+          m_start(start), m_chunk(std::max<size_t>(1, options.read_size))
+    {
+#if defined(TOKS_HAS_INOTIFY)
+        // the directory is watched so that the new file of a rotation is seen as well
+        const size_t slash = m_path.rfind('/');
+        const std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : m_path.substr(0, slash);
+        m_notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_notify >= 0 && ::inotify_add_watch(m_notify, directory.c_str(),
+                IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB) < 0) {
+            ::close(m_notify);
+            m_notify = -1;
+        }
+#endif
+    }
+
+    FileFollower(const FileFollower&) = delete;
+    FileFollower& operator=(const FileFollower&) = delete;
+
+    ~FileFollower() {
+        close();
+#if defined(TOKS_HAS_INOTIFY)
+        if (m_notify >= 0) {
+            ::close(m_notify);
+        }
+#endif
+    }
+
+    // reads the bytes appended since the last call, and gives the tokens that became certain to the callback
+    // returns the amount of bytes read
+    size_t poll(const Callback& callback) {
+        if (m_fd < 0) {
+            if (!open(m_start)) {
+                return 0;
+            }
+            m_start = FollowPosition(); // the files after a rotation are read from their beginning
+        }
+
+        size_t total = 0;
+        struct stat path_stat, file_stat;
+        const bool replaced = ::stat(m_path.c_str(), &path_stat) == 0
+                              && (path_stat.st_ino != m_inode || path_stat.st_dev != m_device);
+        const bool truncated = !replaced && ::fstat(m_fd, &file_stat) == 0
+                               && static_cast<size_t>(file_stat.st_size) < m_read_offset;
+        if (replaced || truncated) {
+            if (replaced) {
+                total += read_available(callback); // the last bytes written to the old file
+            }
+            emit(m_streaming.finish(), callback);
+            if (truncated) {
+                restart(FollowPosition());
+            } else {
+                close();
+                if (!open(FollowPosition())) {
+                    return total;
+                }
+            }
+        }
+        return total + read_available(callback);
+    }
+
+    // polls the file until stop is called (from another thread or from the callback)
+    void run(const Callback& callback) {
+        while (!m_stopped.load(std::memory_order_acquire)) {
+            poll(callback);
+            if (m_stopped.load(std::memory_order_acquire)) {
+                break;
+            }
+            wait();
+        }
+    }
+
+    // makes run return (within the poll interval)
+    void stop() {
+        m_stopped.store(true, std::memory_order_release);
+    }
+
+    // returns the position of the first byte that is not lexed yet
+    // A FileFollower started there later (with the same file) gives the tokens that follow.
+    FollowPosition committed() const {
+        return FollowPosition{m_base + m_streaming.offset() + m_dropped, m_streaming.line(), m_streaming.column()};
+    }
+};
+
+#endif
+
+namespace detail {
+
+// The types and the values of tokens being packed (see PackedToken)
+class TokenPacker {
+private:
+    // how far after the offset of a token its value is looked for in the source
+    static constexpr size_t value_window = 4096;
+
+    std::unordered_map<const char *, uint32_t> m_ids;
+    std::map<std::string, uint32_t> m_ids_by_name; // (two pointers may hold the same name)
+    std::vector<std::string> m_names;
+    std::vector<const char *> m_types; // the first pointer met for each type
+    std::string m_values;
+
+public:
+    // returns the index of the type, adding it to the table
+    uint32_t type_id(const char *type) {
+        auto found = m_ids.find(type);
+        if (found != m_ids.end()) {
+            return found->second;
+        }
+        const std::string name = type != nullptr ? type : "";
+        auto named = m_ids_by_name.emplace(name, static_cast<uint32_t>(m_names.size()));
+        if (named.second) {
+            m_names.push_back(name);
+            m_types.push_back(type);
+        }
+        m_ids.emplace(type, named.first->second);
+        return named.first->second;
+    }
+
+    // packs a token of the normalized text
+    PackedToken pack(const TokenInfo& token, const std::string& text) {
+        PackedToken packed{token.offset, token.offset, static_cast<uint32_t>(token.value.size()), type_id(token.token_type)};
+        if (text.compare(std::min(token.offset, text.size()), token.value.size(), token.value) == 0) {
+            return packed;
+        }
+        // the values that do not start the token, like the content of a pair, come soon after
+        const size_t end = std::min(text.size(), token.offset + token.value.size() + value_window);
+        const size_t found = token.offset < end ? text.find(token.value, token.offset) : std::string::npos;
+        if (found != std::string::npos && found + token.value.size() <= end) {
+            packed.value = found;
+            return packed;
+        }
+        packed.value = m_values.size();
+        packed.type |= PackedToken::out_of_line;
+        m_values += token.value;
+        return packed;
+    }
+
+    const std::vector<std::string>& names() const {
+        return m_names;
+    }
+
+    // returns the type names as the tokens had them
+    const std::vector<const char *>& types() const {
+        return m_types;
+    }
+
+    // the values that are not in the source
+    const std::string& values() const {
+        return m_values;
+    }
+};
+
+// A file mapped in memory read only (or read in memory without mmap), or a buffer of memory
+class MappedFile {
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<uint64_t> m_owned; // (8 bytes aligned)
+
+    void release() {
+#if defined(TOKS_HAS_POSIX_IO)
+        if (m_mapped) {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+#endif
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_owned.clear();
+    }
+
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            release();
+            m_data = other.m_data;
+            m_size = other.m_size;
+            m_mapped = other.m_mapped;
+            m_owned = std::move(other.m_owned);
+            other.m_data = nullptr;
+            other.m_size = 0;
+            other.m_mapped = false;
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        release();
+    }
+
+    // maps the file, returns false if it cannot be opened
+    bool open(const std::string& path) {
+        release();
+#if defined(TOKS_HAS_POSIX_IO)
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        m_size = static_cast<size_t>(info.st_size);
+        if (m_size != 0) {
+            void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                m_size = 0;
+                return false;
+            }
+            m_data = static_cast<const char *>(data);
+            m_mapped = true;
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        file.seekg(0, std::ios::end);
+        m_size = static_cast<size_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+        m_owned.resize((m_size + 7) / 8);
+        file.read(reinterpret_cast<char *>(m_owned.data()), static_cast<std::streamsize>(m_size));
+        m_size = static_cast<size_t>(file.gcount());
+        m_data = reinterpret_cast<const char *>(m_owned.data());
+        return true;
+#endif
+    }
+
+    // takes the first size bytes of the buffer
+    void own(std::vector<uint64_t>&& buffer, size_t size) {
+        release();
+        m_owned = std::move(buffer);
+        m_data = reinterpret_cast<const char *>(m_owned.data());
+        m_size = size;
+    }
+
+    const char *data() const {
+        return m_data;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    bool mapped() const {
+        return m_mapped;
+    }
+};
+
+// the size and the modification time (in nanoseconds) of a file, false if it does not exist
+inline bool file_stamp(const std::string& path, uint64_t& size, int64_t& modified) {
+#if defined(TOKS_HAS_POSIX_IO)
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    size = static_cast<uint64_t>(info.st_size);
+#if defined(__APPLE__)
+    modified = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    modified = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    return true;
+#else
+    (void)path;
+    size = 0;
+    modified = -1; // unknown, the source is always compared by its hash
+    return false;
+#endif
+}
+
+} // namespace detail
+
+// The tokens of a source in a file made to be mapped in memory and read in place (see Tokenizer::load_or_tokenize)
+//
+// The file holds a header (the fingerprint of the grammar, the hash, size and modification time of the
+// source), the table of the type names, the packed tokens, the offsets of the lines, the normalized
+// source and the values that are not in the source. The sections are 8 bytes aligned and in the byte
+// order of the machine that wrote them (another byte order is an invalid cache).
+class TokenCache {
+public:
+    struct Header {
+        char magic[8]; // "TOKCACHE"
+        uint32_t version;
+        uint32_t byte_order; // 0x01020304 as written
+        uint64_t grammar; // Tokenizer::fingerprint
+        uint64_t source_hash; // of the bytes of the source, before normalization
+        uint64_t source_size;
+        int64_t source_modified; // in nanoseconds, -1 if unknown
+        uint64_t token_count;
+        uint64_t line_count;
+        uint64_t type_count;
+        uint64_t text_size;
+        uint64_t values_size;
+        // the offsets of the sections in the file
+        uint64_t types; // type_count (offset from types, length) pairs of uint32_t, then the names (0 terminated)
+        uint64_t tokens; // token_count PackedToken
+        uint64_t lines; // line_count uint64_t, the offsets where the lines start
+        uint64_t text; // the normalized source
+        uint64_t values; // the values that are not in the source
+        uint64_t file_size;
+    };
+
+    static constexpr uint32_t version = 1;
+
+private:
+    detail::MappedFile m_file;
+    const Header *m_header = nullptr;
+    const PackedToken *m_tokens = nullptr;
+    const uint64_t *m_lines = nullptr;
+    const char *m_text = nullptr;
+    const char *m_values = nullptr;
+    std::vector<const char *> m_types;
+    bool m_from_cache = false;
+
+    static size_t aligned(size_t size) {
+        return (size + 7) & ~size_t(7);
+    }
+
+    // returns true if the file holds a cache whose sections are all in the file
+    // (the tokens themselves are trusted, to open a cache in constant time, see verify)
+    bool attach(const Tokenizer *tokenizer);
+
+public:
+    TokenCache() = default;
+
+    TokenCache(TokenCache&&) = default;
+    TokenCache& operator=(TokenCache&&) = default;
+
+    // opens a cache file, throws if it is not one
+    // The type names of the tokens are the ones of the tokenizer when given (so that they can be
+    // compared by address like the ones of Tokenizer::tokenize), the ones in the file otherwise.
+    static TokenCache open(const std::string& path, const Tokenizer *tokenizer = nullptr) {
+        TokenCache cache;
+        if (!cache.m_file.open(path) || !cache.attach(tokenizer)) {
+            throw std::runtime_error("Invalid token cache " + path);
+        }
+        cache.m_from_cache = true;
+        return cache;
+    }
+
+    // makes the cache of the tokens of the source (a string of source_size bytes whose normalization is text)
+    static TokenCache build(const Tokenizer& tokenizer, const std::vector<TokenInfo>& tokens, const std::string& text,
+                            uint64_t source_hash, uint64_t source_size, int64_t source_modified);
+
+    // returns true if every token and line is within the file (a cache is written whole, through a rename,
+    // this is for the files that may have been damaged or made by something else)
+    bool verify() const;
+
+    // returns the header of the file
+    const Header& header() const {
+        return *m_header;
+    }
+
+    // returns true if the tokens were read from an existing file (rather than tokenized)
+    bool from_cache() const {
+        return m_from_cache;
+    }
+
+    // returns the bytes of the file
+    const char *data() const {
+        return m_file.data();
+    }
+
+    size_t file_size() const {
+        return m_file.size();
+    }
+
+    size_t size() const {
+        return m_header != nullptr ? static_cast<size_t>(m_header->token_count) : 0;
+    }
+
+    const PackedToken& packed(size_t index) const {
+        return m_tokens[index];
+    }
+
+    // returns the normalized source
+    std::string_view text() const {
+        return std::string_view(m_text, m_header != nullptr ? static_cast<size_t>(m_header->text_size) : 0);
+    }
+
+    const char *type(size_t index) const {
+        return m_types[m_tokens[index].type_id()];
+    }
+
+    // returns the value of the token, in place
+    std::string_view value(size_t index) const {
+        const PackedToken& token = m_tokens[index];
+        return std::string_view((token.value_out_of_line() ? m_values : m_text) + token.value, token.length);
+    }
+
+    size_t offset(size_t index) const {
+        return static_cast<size_t>(m_tokens[index].offset);
+    }
+
+    // returns the line of an offset of the normalized source (from 0, like TokenInfo::line)
+    size_t line_of(size_t offset) const {
+        const uint64_t *end = m_lines + m_header->line_count;
+        return static_cast<size_t>(std::upper_bound(m_lines, end, static_cast<uint64_t>(offset)) - m_lines) - 1;
+    }
+
+    size_t line(size_t index) const {
+        return line_of(offset(index));
+    }
+
+    size_t column(size_t index) const {
+        return offset(index) - static_cast<size_t>(m_lines[line(index)]);
+    }
+
+    // returns the token as Tokenizer::tokenize does
+    TokenInfo token(size_t index) const {
+        const std::string_view value = this->value(index);
+        const size_t line = this->line(index);
+        TokenInfo token(type(index), std::string(value.data(), value.size()), line,
+                        offset(index) - static_cast<size_t>(m_lines[line]));
+        token.offset = offset(index);
+        return token;
+    }
+
+    std::vector<TokenInfo> tokens() const {
+        std::vector<TokenInfo> out;
+        out.reserve(size());
+        for (size_t i = 0; i < size(); ++i) {
+            out.push_back(token(i));
+        }
+        return out;
+    }
+};
+
+inline bool TokenCache::attach(const Tokenizer *tokenizer) {
+    const char *data = m_file.data();
+    const uint64_t size = m_file.size();
+    if (size < sizeof(Header)) {
+        return false;
+    }
+    m_header = reinterpret_cast<const Header *>(data);
+    const Header& h = *m_header;
+    // (every section is checked against the size of the file, without overflowing)
+    auto within = [&](uint64_t offset, uint64_t count, uint64_t item) {
+        return offset % 8 == 0 && offset <= size && (item == 0 || count <= (size - offset) / item);
+    };
+    if (memcmp(h.magic, "TOKCACHE", 8) != 0 || h.version != version || h.byte_order != 0x01020304
+        || h.file_size != size || h.line_count == 0 || !within(h.types, h.type_count, 8)
+        || !within(h.tokens, h.token_count, sizeof(PackedToken)) || !within(h.lines, h.line_count, 8)
+        || !within(h.text, h.text_size, 1) || !within(h.values, h.values_size, 1)) {
+        m_header = nullptr;
+        return false;
+    }
+    m_tokens = reinterpret_cast<const PackedToken *>(data + h.tokens);
+    m_lines = reinterpret_cast<const uint64_t *>(data + h.lines);
+    m_text = data + h.text;
+    m_values = data + h.values;
+
+    // the names, by the pointers of the tokenizer when it has them
+    std::unordered_map<std::string, const char *> known;
+    if (tokenizer != nullptr) {
+        for (auto& parser : tokenizer->parsers()) {
+            known.emplace(parser->token_type(), parser->token_type());
+        }
+        if (tokenizer->default_type() != nullptr) {
+            known.emplace(tokenizer->default_type(), tokenizer->default_type());
+        }
+    }
+    const uint32_t *table = reinterpret_cast<const uint32_t *>(data + h.types);
+    m_types.clear();
+    for (uint64_t i = 0; i < h.type_count; ++i) {
+        const uint64_t name = h.types + table[2 * i], length = table[2 * i + 1];
+        if (name + length >= size || data[name + length] != '\0') {
+            m_header = nullptr;
+            return false;
+        }
+        auto found = known.find(std::string(data + name, length));
+        m_types.push_back(found != known.end() ? found->second : data + name);
+    }
+    return true;
+}
+
+inline bool TokenCache::verify() const {
+    if (m_header == nullptr) {
+        return false;
+    }
+    const Header& h = *m_header;
+    for (uint64_t i = 0; i < h.token_count; ++i) {
+        const PackedToken& token = m_tokens[i];
+        const uint64_t limit = token.value_out_of_line() ? h.values_size : h.text_size;
+        if (token.type_id() >= h.type_count || token.value > limit || token.length > limit - token.value
+            || token.offset > h.text_size) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < h.line_count; ++i) {
+        if (m_lines[i] > h.text_size || (i != 0 && m_lines[i] <= m_lines[i - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline TokenCache TokenCache::build(const Tokenizer& tokenizer, const std::vector<TokenInfo>& tokens,
+                                    const std::string& text, uint64_t source_hash, uint64_t source_size,
+                                    int64_t source_modified) {
+    detail::TokenPacker packer;
+    std::vector<PackedToken> packed;
+    packed.reserve(tokens.size());
+    for (auto& token : tokens) {
+        packed.push_back(packer.pack(token, text));
+    }
+    std::vector<uint64_t> lines(1, 0);
+    for (size_t pos = text.find('\n'); pos != std::string::npos; pos = text.find('\n', pos + 1)) {
+        lines.push_back(pos + 1);
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TOKCACHE", 8);
+    h.version = version;
+    h.byte_order = 0x01020304;
+    h.grammar = tokenizer.fingerprint();
+    h.source_hash = source_hash;
+    h.source_size = source_size;
+    h.source_modified = source_modified;
+    h.token_count = packed.size();
+    h.line_count = lines.size();
+    h.type_count = packer.names().size();
+    h.text_size = text.size();
+    h.values_size = packer.values().size();
+
+    size_t names_size = 0;
+    for (auto& name : packer.names()) {
+        names_size += name.size() + 1;
+    }
+    h.types = aligned(sizeof(Header));
+    h.tokens = aligned(h.types + h.type_count * 8 + names_size);
+    h.lines = h.tokens + h.token_count * sizeof(PackedToken);
+    h.text = h.lines + h.line_count * 8;
+    h.values = aligned(h.text + h.text_size);
+    h.file_size = h.values + h.values_size;
+
+    std::vector<uint64_t> buffer(aligned(static_cast<size_t>(h.file_size)) / 8);
+    char *out = reinterpret_cast<char *>(buffer.data());
+    memcpy(out, &h, sizeof(h));
+    uint32_t *table = reinterpret_cast<uint32_t *>(out + h.types);
+    size_t name = h.type_count * 8;
+    for (size_t i = 0; i < packer.names().size(); ++i) {
+        const std::string& type = packer.names()[i];
+        table[2 * i] = static_cast<uint32_t>(name);
+        table[2 * i + 1] = static_cast<uint32_t>(type.size());
+        memcpy(out + h.types + name, type.c_str(), type.size() + 1);
+        name += type.size() + 1;
+    }
+    if (!packed.empty()) {
+        memcpy(out + h.tokens, packed.data(), packed.size() * sizeof(PackedToken));
+    }
+    memcpy(out + h.lines, lines.data(), lines.size() * 8);
+    memcpy(out + h.text, text.data(), text.size());
+    memcpy(out + h.values, packer.values().data(), packer.values().size());
+
+    TokenCache cache;
+    cache.m_file.own(std::move(buffer), static_cast<size_t>(h.file_size));
+    cache.attach(&tokenizer);
+    return cache;
+}
+
+namespace detail {
+
+inline void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// reads a varint, throws at the end of the data or on more than 64 bits
+inline uint64_t get_varint(const char *&data, const char *end) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (data == end) {
+            break;
+        }
+        const auto byte = static_cast<unsigned char>(*data++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Invalid encoded tokens");
+}
+
+// returns the bits needed to write the values below count
+inline unsigned bits_for(size_t count) {
+    unsigned bits = 0;
+    while ((size_t(1) << bits) < count) {
+        ++bits;
+    }
+    return bits;
+}
+
+} // namespace detail
+
+// Options of EncodedTokens::encode
+struct TokenEncodeOptions {
+    // the tokens of a block (the unit of random access)
+    size_t block_size = 1024;
+    // the values that are not the same for every token of their type (like the default words) are stored,
+    // so that the tokens can be decoded without the source (the encoding gets bigger)
+    bool embed_values = false;
+};
+
+// A compact encoding of tokens, for storage and transport, decoded a block at a time
+//
+// Every block starts with the offset, line and column of its first token; each following token stores the
+// delta of its offset, of its line (and its column when it is on a new line) as varints. The types of a block
+// are a small dictionary of the types it has and a bit packed index per token, like the way each value is
+// stored: the value every token of the type has (a keyword, stored once with the type), a range of the source
+// at the offset or at a delta after it (a varint length and delta), or the bytes themselves (when they are not
+// in the source, or with embed_values).
+class EncodedTokens {
+private:
+    enum ValueKind : uint8_t { Constant, AtOffset, AtDelta, Inline };
+
+    struct Block {
+        size_t first; // the index of the first token
+        size_t count;
+        size_t begin; // the range of the block in m_data
+        size_t end;
+    };
+
+    std::vector<char> m_names; // the type names, 0 terminated (a vector, so that moving keeps their address)
+    std::vector<size_t> m_name_offsets;
+    std::vector<const char *> m_types; // the type names given to the tokens
+    std::vector<char> m_has_constant;
+    std::vector<std::string> m_constants; // the value of every token of the type, when m_has_constant
+    std::vector<Block> m_blocks;
+    std::string m_data; // the blocks
+    size_t m_size = 0;
+    bool m_needs_source = false;
+
+    void add_type(const std::string& name) {
+        m_name_offsets.push_back(m_names.size());
+        m_names.insert(m_names.end(), name.begin(), name.end());
+        m_names.push_back('\0');
+    }
+
+    void resolve_types() {
+        m_types.clear();
+        for (size_t offset : m_name_offsets) {
+            m_types.push_back(m_names.data() + offset);
+        }
+    }
+
+    // appends a block of count tokens from first (the kinds and deltas of their values are computed by encode)
+    void encode_block(const std::vector<TokenInfo>& tokens, const std::vector<uint32_t>& types, size_t first, size_t count,
+                      const std::vector<uint32_t>& deltas, const std::vector<uint8_t>& kinds) {
+        Block block{first, count, m_data.size(), 0};
+        // the dictionary of the types of the block
+        std::vector<uint32_t> dictionary;
+        std::unordered_map<uint32_t, uint32_t> local;
+        for (size_t i = first; i < first + count; ++i) {
+            if (local.emplace(types[i], static_cast<uint32_t>(dictionary.size())).second) {
+                dictionary.push_back(types[i]);
+            }
+        }
+        detail::put_varint(m_data, count);
+        detail::put_varint(m_data, dictionary.size());
+        for (uint32_t type : dictionary) {
+            detail::put_varint(m_data, type);
+        }
+        // the bit packed types and value kinds
+        const unsigned type_bits = detail::bits_for(dictionary.size());
+        const unsigned bits = type_bits + 2;
+        std::string packed((count * bits + 7) / 8, '\0');
+        for (size_t i = 0; i < count; ++i) {
+            const uint32_t value = (local[types[first + i]] << 2) | kinds[first + i];
+            for (unsigned b = 0; b < bits; ++b) {
+                if (value & (1u << b)) {
+                    const size_t bit = i * bits + b;
+                    packed[bit / 8] = static_cast<char>(packed[bit / 8] | (1 << (bit % 8)));
+                }
+            }
+        }
+        m_data += packed;
+
+        const TokenInfo& head = tokens[first];
+        detail::put_varint(m_data, head.offset);
+        detail::put_varint(m_data, head.line);
+        detail::put_varint(m_data, head.column);
+        for (size_t i = first; i < first + count; ++i) {
+            const TokenInfo& token = tokens[i];
+            if (i != first) {
+                const TokenInfo& previous = tokens[i - 1];
+                detail::put_varint(m_data, token.offset - previous.offset);
+                detail::put_varint(m_data, token.line - previous.line);
+                if (token.line != previous.line) {
+                    detail::put_varint(m_data, token.column);
+                }
+            }
+            switch (kinds[i]) {
+                case Constant: break;
+                case AtOffset: detail::put_varint(m_data, token.value.size()); break;
+                case AtDelta:
+                    detail::put_varint(m_data, token.value.size());
+                    detail::put_varint(m_data, deltas[i]);
+                    break;
+                default:
+                    detail::put_varint(m_data, token.value.size());
+                    m_data += token.value;
+                    break;
+            }
+        }
+        block.end = m_data.size();
+        m_blocks.push_back(block);
+    }
+
+public:
+    // encodes the tokens of the normalized text (the text given to the tokenizer, after normalization)
+    // The tokens must be in the order of their offsets, as the tokenizer returns them.
+    static EncodedTokens encode(const std::vector<TokenInfo>& tokens, const std::string& text,
+                                const TokenEncodeOptions& options = TokenEncodeOptions()) {
+        EncodedTokens encoded;
+        detail::TokenPacker packer;
+        std::vector<uint32_t> types(tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            types[i] = packer.type_id(tokens[i].token_type);
+        }
+        // the types whose tokens all have the same value
+        const size_t type_count = packer.names().size();
+        encoded.m_has_constant.assign(type_count, 2); // 2 until a token of the type is seen
+        encoded.m_constants.assign(type_count, std::string());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            char& has = encoded.m_has_constant[types[i]];
+            if (has == 2) {
+                has = 1;
+                encoded.m_constants[types[i]] = tokens[i].value;
+            } else if (has == 1 && encoded.m_constants[types[i]] != tokens[i].value) {
+                has = 0;
+                encoded.m_constants[types[i]].clear();
+            }
+        }
+        for (auto& name : packer.names()) {
+            encoded.add_type(name);
+        }
+
+        std::vector<uint8_t> kinds(tokens.size());
+        std::vector<uint32_t> deltas(tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const TokenInfo& token = tokens[i];
+            if (encoded.m_has_constant[types[i]] == 1) {
+                kinds[i] = Constant;
+                continue;
+            }
+            kinds[i] = Inline;
+            if (options.embed_values) {
+                continue;
+            }
+            const PackedToken packed = packer.pack(token, text);
+            if (!packed.value_out_of_line() && packed.value >= token.offset && packed.value - token.offset <= UINT32_MAX) {
+                deltas[i] = static_cast<uint32_t>(packed.value - token.offset);
+                kinds[i] = deltas[i] == 0 ? AtOffset : AtDelta;
+                encoded.m_needs_source = true;
+            }
+        }
+        const size_t block_size = std::max<size_t>(options.block_size, 1);
+        for (size_t first = 0; first < tokens.size(); first += block_size) {
+            encoded.encode_block(tokens, types, first, std::min(block_size, tokens.size() - first), deltas, kinds);
+        }
+        encoded.m_size = tokens.size();
+        encoded.resolve_types();
+        return encoded;
+    }
+
+    // returns the amount of tokens
+    size_t size() const {
+        return m_size;
+    }
+
+    size_t block_count() const {
+        return m_blocks.size();
+    }
+
+    // returns the block of the token
+    size_t block_of(size_t index) const {
+        auto found = std::upper_bound(m_blocks.begin(), m_blocks.end(), index,
+                                      [](size_t i, const Block& block) { return i < block.first; });
+        return static_cast<size_t>(found - m_blocks.begin()) - 1;
+    }
+
+    // returns the index of the first token of the block
+    size_t block_first(size_t block) const {
+        return m_blocks[block].first;
+    }
+
+    // returns true if the values of some tokens are ranges of the source (see TokenEncodeOptions::embed_values)
+    bool needs_source() const {
+        return m_needs_source;
+    }
 
-            if (token != nullptr) {
-                if (token->value.empty()) {
-                    throw TokenizerError(stream.line(), stream.column());
+    // gives the tokens the type names of the tokenizer (so that they can be compared by address
+    // like the ones of Tokenizer::tokenize) instead of their own copies
+    void use_types_of(const Tokenizer& tokenizer);
+
+    // appends the tokens of the block to out
+    // text is the normalized text the tokens were encoded from, needed when needs_source()
+    // The types of the tokens point to the names kept by this object, which must then outlive them,
+    // unless they are the ones of a tokenizer (see use_types_of and from_bytes).
+    void decode_block(size_t block, std::vector<TokenInfo>& out, const std::string *text = nullptr) const {
+        if (m_needs_source && text == nullptr) {
+            throw std::invalid_argument("The encoded tokens need their source");
+        }
+        const Block& b = m_blocks[block];
+        const char *data = m_data.data() + b.begin;
+        const char *end = m_data.data() + b.end;
+        auto varint = [&]() {
+            return detail::get_varint(data, end);
+        };
+        auto fail = []() {
+            throw std::runtime_error("Invalid encoded tokens");
+        };
+
+        const size_t count = static_cast<size_t>(varint());
+        const size_t dictionary_size = static_cast<size_t>(varint());
+        if (count != b.count || dictionary_size > m_types.size()) {
+            fail();
+        }
+        std::vector<uint32_t> dictionary(dictionary_size);
+        for (auto& type : dictionary) {
+            type = static_cast<uint32_t>(varint());
+            if (type >= m_types.size()) {
+                fail();
+            }
+        }
+        const unsigned bits = detail::bits_for(dictionary_size) + 2;
+        const size_t packed_size = (count * bits + 7) / 8;
+        if (static_cast<size_t>(end - data) < packed_size) {
+            fail();
+        }
+        const auto *packed = reinterpret_cast<const unsigned char *>(data);
+        data += packed_size;
+
+        size_t offset = static_cast<size_t>(varint());
+        size_t line = static_cast<size_t>(varint());
+        size_t column = static_cast<size_t>(varint());
+        out.reserve(out.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t value = 0;
+            for (unsigned bit = 0; bit < bits; ++bit) {
+                const size_t at = i * bits + bit;
+                value |= static_cast<uint32_t>((packed[at / 8] >> (at % 8)) & 1) << bit;
+            }
+            const uint32_t local = value >> 2;
+            if (local >= dictionary_size) {
+                fail();
+            }
+            const uint32_t type = dictionary[local];
+            if (i != 0) {
+                const size_t delta = static_cast<size_t>(varint());
+                const size_t lines = static_cast<size_t>(varint());
+                offset += delta;
+                if (lines != 0) {
+                    line += lines;
+                    column = static_cast<size_t>(varint());
                 } else {
-                    tokens.push_back(*token);
+                    column += delta;
+                }
+            }
+
+            out.emplace_back(m_types[type], std::string(), line, column);
+            TokenInfo& token = out.back();
+            token.offset = offset;
+            switch (value & 3) {
+                case Constant:
+                    if (!m_has_constant[type]) {
+                        fail();
+                    }
+                    token.value = m_constants[type];
+                    break;
+                case AtOffset:
+                case AtDelta: {
+                    const size_t length = static_cast<size_t>(varint());
+                    const size_t start = offset + ((value & 3) == AtDelta ? static_cast<size_t>(varint()) : 0);
+                    // (a damaged header may claim no token needs the source)
+                    if (text == nullptr || start > text->size() || length > text->size() - start) {
+                        fail();
+                    }
+                    token.value.assign(*text, start, length);
+                    break;
+                }
+                default: {
+                    const size_t length = static_cast<size_t>(varint());
+                    if (length > static_cast<size_t>(end - data)) {
+                        fail();
+                    }
+                    token.value.assign(data, length);
+                    data += length;
+                    break;
                 }
             }
         }
-        return tokens;
     }
 
-    // returns the callbacks for each token parser
-    const std::unordered_map<const char *, ParserCallback>& callbacks() const {
-        return m_callbacks;
+    // returns all the tokens (see decode_block, the object must outlive them unless use_types_of was called)
+    std::vector<TokenInfo> decode(const std::string *text = nullptr) const {
+        std::vector<TokenInfo> out;
+        out.reserve(m_size);
+        for (size_t block = 0; block < m_blocks.size(); ++block) {
+            decode_block(block, out, text);
+        }
+        return out;
     }
 
+    // returns the encoding as bytes, to store or send (see from_bytes)
+    std::string bytes() const {
+        std::string out = "TOKZ";
+        detail::put_varint(out, 1); // the version
+        detail::put_varint(out, m_needs_source ? 1 : 0);
+        detail::put_varint(out, m_name_offsets.size());
+        for (size_t i = 0; i < m_name_offsets.size(); ++i) {
+            const char *name = m_names.data() + m_name_offsets[i];
+            const size_t length = strlen(name);
+            detail::put_varint(out, length);
+            out.append(name, length);
+            detail::put_varint(out, m_has_constant[i] == 1 ? 1 : 0);
+            if (m_has_constant[i] == 1) {
+                detail::put_varint(out, m_constants[i].size());
+                out += m_constants[i];
+            }
+        }
+        detail::put_varint(out, m_blocks.size());
+        for (auto& block : m_blocks) {
+            detail::put_varint(out, block.count);
+            detail::put_varint(out, block.end - block.begin);
+        }
+        out += m_data;
+        return out;
+    }
 
+    // reads the bytes of an encoding, throws if they are not one
+    // With a tokenizer, the tokens get its type names (see use_types_of), and the decoded tokens
+    // can outlive the object as long as their types are all registered in it.
+    static EncodedTokens from_bytes(const std::string& bytes, const Tokenizer *tokenizer = nullptr) {
+        EncodedTokens encoded;
+        const char *data = bytes.data();
+        const char *end = data + bytes.size();
+        auto varint = [&]() {
+            return detail::get_varint(data, end);
+        };
+        auto string = [&](std::string& out) {
+            const size_t length = static_cast<size_t>(varint());
+            if (length > static_cast<size_t>(end - data)) {
+                throw std::runtime_error("Invalid encoded tokens");
+            }
+            out.assign(data, length);
+            data += length;
+        };
+        if (bytes.compare(0, 4, "TOKZ") != 0) {
+            throw std::runtime_error("Invalid encoded tokens");
+        }
+        data += 4;
+        if (varint() != 1) {
+            throw std::runtime_error("Unsupported encoded tokens version");
+        }
+        encoded.m_needs_source = varint() != 0;
+        const size_t type_count = static_cast<size_t>(varint());
+        if (type_count > bytes.size()) {
+            throw std::runtime_error("Invalid encoded tokens");
+        }
+        std::string name;
+        for (size_t i = 0; i < type_count; ++i) {
+            string(name);
+            encoded.add_type(name);
+            const bool constant = varint() != 0;
+            encoded.m_has_constant.push_back(constant ? 1 : 0);
+            encoded.m_constants.emplace_back();
+            if (constant) {
+                string(encoded.m_constants.back());
+            }
+        }
+        const size_t block_count = static_cast<size_t>(varint());
+        if (block_count > bytes.size()) {
+            throw std::runtime_error("Invalid encoded tokens");
+        }
+        size_t position = 0;
+        for (size_t i = 0; i < block_count; ++i) {
+            Block block;
+            block.first = encoded.m_size;
+            block.count = static_cast<size_t>(varint());
+            block.begin = position;
+            position += static_cast<size_t>(varint());
+            block.end = position;
+            encoded.m_size += block.count;
+            encoded.m_blocks.push_back(block);
+        }
+        if (position != static_cast<size_t>(end - data)) {
+            throw std::runtime_error("Invalid encoded tokens");
+        }
+        encoded.m_data.assign(data, position);
+        if (tokenizer != nullptr) {
+            encoded.use_types_of(*tokenizer);
+        } else {
+            encoded.resolve_types();
+        }
+        return encoded;
+    }
 };
 
-ParserCallbackResult CombinatorParser::parser_callback(FileTokenStream& s, TokenParser& parser) {
-    auto& combinator = dynamic_cast<CombinatorParser&>(parser);
-    s.push_state();
+// The tokens of a text kept packed (see PackedToken) within a memory budget: once the blocks of tokens
+// would exceed it, the full blocks are written to a temporary file (removed from the directory as soon as
+// it is made) and read back through mmap. The values are ranges of the text, which the container borrows
+// when it is normalized (it must then outlive the container) and copies otherwise (the copy is taken from the
+// budget). A value that is not found in the text is kept in memory, taken from the budget as well. Only the line
+// of the first token of every block is kept, the lines of the others are found again from the text when their
+// block is read.
+// The tokens are read by index, or by iterating, as TokenInfo made on the fly.
+// Without mmap (outside of POSIX systems) every block stays in memory.
+class SpillingTokens {
+private:
+    SpillOptions m_options;
+    std::string m_storage; // the normalized copy of the text, if it needed one
+    const std::string *m_text = &m_storage;
+    detail::TokenPacker m_packer;
+    // the line of the first token of every block, and the offset where it starts
+    std::vector<std::pair<uint64_t, uint64_t>> m_block_lines;
+    size_t m_line = 0; // the line at m_scanned, and where it starts
+    size_t m_line_start = 0;
+    size_t m_scanned = 0;
+    // the line of the last token read (its block, offset, line and the start of the line)
+    mutable size_t m_cursor_block = static_cast<size_t>(-1);
+    mutable size_t m_cursor_offset = 0;
+    mutable size_t m_cursor_line = 0;
+    mutable size_t m_cursor_line_start = 0;
+    std::vector<std::vector<PackedToken>> m_blocks; // the blocks kept in memory (the first ones)
+    std::vector<PackedToken> m_tail; // the block being filled
+    size_t m_spilled = 0; // the blocks in the file (after the ones in memory)
+    size_t m_size = 0;
 
-    auto token = make_parser_callback_result(combinator.token_type(), "", s.line(), s.column());
+    int m_fd = -1;
+    mutable const char *m_map = nullptr;
+    mutable size_t m_map_size = 0;
 
-    for (auto& p : combinator.parsers()) {
-        auto info = combinator.m_tokenizer_ref.callbacks().at(p->parser_type())(s, *p);
+    size_t block_bytes() const {
+        return m_options.block_tokens * sizeof(PackedToken);
+    }
 
-        if (info == nullptr) {
-            s.pop_state();
-            return nullptr;
+    void unmap() const {
+#if defined(TOKS_HAS_POSIX_IO)
+        if (m_map != nullptr) {
+            munmap(const_cast<char *>(m_map), m_map_size);
         }
-        token->value += info->value;
+#endif
+        m_map = nullptr;
+        m_map_size = 0;
     }
-    s.pop_state(false);
-    return token;
+
+    void close_file() {
+        unmap();
+#if defined(TOKS_HAS_POSIX_IO)
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+#endif
+        m_fd = -1;
+        m_spilled = 0;
+    }
+
+    // writes the tail to the file, returns false if the file cannot be used
+    bool spill_tail() {
+#if defined(TOKS_HAS_POSIX_IO)
+        if (m_fd < 0) {
+            std::string directory = m_options.directory;
+            if (directory.empty()) {
+                const char *tmp = getenv("TMPDIR");
+                directory = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+            }
+            std::string path = directory + "/toks-spill-XXXXXX";
+            m_fd = mkstemp(&path[0]);
+            if (m_fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Could not create a file in " + directory);
+            }
+            ::unlink(path.c_str());
+        }
+        const char *data = reinterpret_cast<const char *>(m_tail.data());
+        const off_t at = static_cast<off_t>(m_spilled * block_bytes());
+        size_t done = 0;
+        while (done < block_bytes()) {
+            const ssize_t written = pwrite(m_fd, data + done, block_bytes() - done, at + static_cast<off_t>(done));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                throw std::system_error(errno, std::generic_category(), "Could not write the spilled tokens");
+            }
+            done += static_cast<size_t>(written);
+        }
+        ++m_spilled;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // returns the spilled block, mapping the file again when it grew past the mapping
+    const PackedToken *spilled_block(size_t index) const {
+#if defined(TOKS_HAS_POSIX_IO)
+        const size_t end = (index + 1) * block_bytes();
+        if (end > m_map_size) {
+            unmap();
+            void *map = mmap(nullptr, m_spilled * block_bytes(), PROT_READ, MAP_SHARED, m_fd, 0);
+            if (map == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "Could not map the spilled tokens");
+            }
+            m_map = static_cast<const char *>(map);
+            m_map_size = m_spilled * block_bytes();
+        }
+        return reinterpret_cast<const PackedToken *>(m_map + index * block_bytes());
+#else
+        (void)index;
+        return nullptr;
+#endif
+    }
+
+    // moves the current line up to the offset
+    void scan_lines(size_t offset) {
+        const std::string& text = *m_text;
+        const size_t end = std::min(offset, text.size());
+        for (size_t pos = text.find('\n', m_scanned); pos != std::string::npos && pos < end; pos = text.find('\n', pos + 1)) {
+            ++m_line;
+            m_line_start = pos + 1;
+        }
+        m_scanned = std::max(m_scanned, end);
+    }
+
+    // returns the line of the token at the offset in the block and where the line starts, counting the lines
+    // from the previous token read when it comes before in the same block (like when iterating), or else
+    // from the first line of the block
+    std::pair<size_t, size_t> line_of(size_t block, size_t offset) const {
+        if (block != m_cursor_block || offset < m_cursor_offset) {
+            m_cursor_block = block;
+            m_cursor_offset = static_cast<size_t>(m_block_lines[block].second);
+            m_cursor_line = static_cast<size_t>(m_block_lines[block].first);
+            m_cursor_line_start = m_cursor_offset;
+        }
+        const std::string& text = *m_text;
+        const size_t end = std::min(offset, text.size());
+        for (size_t pos = text.find('\n', m_cursor_offset); pos != std::string::npos && pos < end; pos = text.find('\n', pos + 1)) {
+            ++m_cursor_line;
+            m_cursor_line_start = pos + 1;
+        }
+        m_cursor_offset = std::max(m_cursor_offset, end);
+        return { m_cursor_line, m_cursor_line_start };
+    }
+
+    // the memory taken from the budget besides the blocks
+    size_t other_memory() const {
+        return m_storage.capacity() + m_packer.values().capacity()
+            + m_block_lines.capacity() * sizeof(m_block_lines[0]);
+    }
+
+    // the memory left to the blocks
+    size_t block_budget() const {
+        return m_options.memory_budget - std::min(m_options.memory_budget, other_memory());
+    }
+
+public:
+    // a forward iterator over the tokens (as TokenInfo made on the fly)
+    class const_iterator {
+    private:
+        const SpillingTokens *m_tokens;
+        size_t m_index;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = TokenInfo;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = TokenInfo;
+
+        const_iterator(const SpillingTokens *tokens, size_t index)
+            : m_tokens(tokens), m_index(index)
+        {}
+
+        TokenInfo operator*() const {
+            return (*m_tokens)[m_index];
+        }
+
+        const_iterator& operator++() {
+            ++m_index;
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator previous = *this;
+            ++m_index;
+            return previous;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return m_index == other.m_index;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return m_index != other.m_index;
+        }
+    };
+
+    explicit SpillingTokens(const SpillOptions& options = SpillOptions())
+        : m_options(options)
+    {
+        m_options.block_tokens = std::max<size_t>(m_options.block_tokens, 1);
+    }
+
+    SpillingTokens(const SpillingTokens&) = delete;
+    SpillingTokens& operator=(const SpillingTokens&) = delete;
+
+    ~SpillingTokens() {
+        close_file();
+    }
+
+    // starts over with the tokens of another text (see the class)
+    void reset(const std::string& text) {
+        close_file();
+        m_storage.clear();
+        if (FileTokenStream::is_normalized(text)) {
+            m_text = &text;
+        } else {
+            m_storage = text;
+            FileTokenStream::normalize(m_storage);
+            m_text = &m_storage;
+        }
+        m_packer = detail::TokenPacker();
+        m_block_lines.clear();
+        m_line = 0;
+        m_line_start = 0;
+        m_scanned = 0;
+        m_cursor_block = static_cast<size_t>(-1);
+        m_blocks.clear();
+        m_tail.clear();
+        m_size = 0;
+    }
+
+    // returns the normalized text the values are read from
+    const std::string& text() const {
+        return *m_text;
+    }
+
+    // adds a token of the text (after the ones already added)
+    void push_back(const TokenInfo& token) {
+        if (m_tail.capacity() < m_options.block_tokens) {
+            m_tail.reserve(m_options.block_tokens);
+        }
+        m_tail.push_back(m_packer.pack(token, *m_text));
+        if (m_tail.size() == 1) {
+            scan_lines(token.offset);
+            m_block_lines.emplace_back(m_line, m_line_start);
+        }
+        ++m_size;
+        if (m_tail.size() < m_options.block_tokens) {
+            return;
+        }
+        // the blocks stay in memory until the budget is reached, then every later one is spilled
+        if ((m_spilled != 0 || (m_blocks.size() + 2) * block_bytes() > block_budget()) && spill_tail()) {
+            m_tail.clear();
+        } else {
+            m_blocks.push_back(std::move(m_tail));
+            m_tail = std::vector<PackedToken>();
+        }
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    // returns the amount of blocks written to the temporary file
+    size_t spilled_blocks() const {
+        return m_spilled;
+    }
+
+    // returns the memory counted in the budget: the packed tokens, the copy of the text, the values that are
+    // not in the text and the lines of the blocks
+    size_t memory_usage() const {
+        return (m_blocks.size() + 1) * block_bytes() + other_memory();
+    }
+
+    PackedToken packed(size_t index) const {
+        const size_t block = index / m_options.block_tokens;
+        const size_t at = index % m_options.block_tokens;
+        if (block < m_blocks.size()) {
+            return m_blocks[block][at];
+        }
+        if (block - m_blocks.size() < m_spilled) {
+            return spilled_block(block - m_blocks.size())[at];
+        }
+        return m_tail[at];
+    }
+
+    const char *type(size_t index) const {
+        return m_packer.types()[packed(index).type_id()];
+    }
+
+    std::string_view value(size_t index) const {
+        const PackedToken token = packed(index);
+        const std::string& source = token.value_out_of_line() ? m_packer.values() : *m_text;
+        return std::string_view(source.data() + token.value, token.length);
+    }
+
+    TokenInfo operator[](size_t index) const {
+        const PackedToken token = packed(index);
+        const std::string& source = token.value_out_of_line() ? m_packer.values() : *m_text;
+        const size_t offset = static_cast<size_t>(token.offset);
+        const auto line = line_of(index / m_options.block_tokens, offset);
+        TokenInfo info(m_packer.types()[token.type_id()], source.substr(static_cast<size_t>(token.value), token.length),
+                       line.first, offset - line.second);
+        info.offset = offset;
+        return info;
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, m_size);
+    }
+};
+
+inline void Tokenizer::tokenize(const std::string& str, SpillingTokens& tokens, bool allow_default_identifiers) const {
+    tokens.reset(str);
+    // the tokens of every slice are moved to the container
+    std::vector<TokenInfo> batch;
+    lex_slices(tokens.text(), allow_default_identifiers, batch, detail::LexRecord(), [&]() {
+        for (auto& token : batch) {
+            tokens.push_back(token);
+        }
+        batch.clear();
+        return true;
+    });
+}
+
+#if defined(TOKS_HAS_POSIX_IO)
+
+// A ring of tokens in POSIX shared memory, written by one process (the producer, see Tokenizer::tokenize)
+// and read in place by another one (the consumer)
+//
+// The memory holds a header, the type names, the token slots and a ring of the bytes of the values.
+// Like SpscQueue, the indices are lock free atomics: the producer waits while the ring is full and the
+// consumer while it is empty, the producer closes the ring once it is done and either side can cancel it.
+// A token read by the consumer (its type, its value) stays in place until it asks for the next one.
+// Each side records its pid, and a side that waits gives up once the other process is gone.
+// (older glibc needs -lrt for shm_open)
+class SharedTokenRing {
+public:
+    // a token read in place
+    struct View {
+        const char *type;
+        std::string_view value;
+        size_t offset;
+        size_t line;
+        size_t column;
+    };
+
+private:
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock free 64 bits atomics");
+
+    struct Header {
+        char magic[8]; // "TOKRING2"
+        uint64_t capacity;
+        uint64_t text_capacity;
+        uint64_t names_capacity;
+        uint64_t max_types;
+        uint64_t size; // of the whole memory
+        alignas(64) std::atomic<uint64_t> head; // the next token to read, written by the consumer
+        alignas(64) std::atomic<uint64_t> tail; // the next token to write, written by the producer
+        std::atomic<uint64_t> text_tail; // the bytes of the values written (the padding included)
+        std::atomic<uint64_t> type_count; // (published before the tokens that use the types)
+        uint64_t names_size;
+        alignas(64) std::atomic<uint32_t> closed;
+        std::atomic<uint32_t> cancelled;
+        std::atomic<int64_t> producer; // the pids, 0 until known
+        std::atomic<int64_t> consumer;
+    };
+
+    static_assert(std::atomic<int64_t>::is_always_lock_free, "the ring needs lock free 64 bits atomics");
+
+    // the waits between two checks that the other process is still there
+    static constexpr unsigned peer_check_interval = 1024;
+
+    struct Slot {
+        uint64_t offset;
+        uint64_t line;
+        uint64_t column;
+        uint64_t value; // the position of the value in the text ring (not wrapped)
+        uint64_t length;
+        uint64_t type;
+    };
+
+    std::string m_name;
+    bool m_owner = false; // the producer removes the name when it is done
+    void *m_memory = nullptr;
+    size_t m_size = 0;
+    Header *m_header = nullptr;
+    uint32_t *m_type_names = nullptr; // the offsets of the names
+    char *m_names = nullptr;
+    Slot *m_slots = nullptr;
+    char *m_text = nullptr;
+
+    // the producer side
+    std::unordered_map<const char *, uint64_t> m_types;
+    // the consumer side: the token given by the last call to next, released by the following one
+    bool m_holding = false;
+
+    static size_t aligned(size_t size) {
+        return (size + 63) & ~size_t(63);
+    }
+
+    void attach(void *memory, size_t size) {
+        m_memory = memory;
+        m_size = size;
+        m_header = static_cast<Header *>(memory);
+        char *bytes = static_cast<char *>(memory);
+        size_t at = aligned(sizeof(Header));
+        m_type_names = reinterpret_cast<uint32_t *>(bytes + at);
+        at = aligned(at + m_header->max_types * sizeof(uint32_t));
+        m_names = bytes + at;
+        at = aligned(at + m_header->names_capacity);
+        m_slots = reinterpret_cast<Slot *>(bytes + at);
+        at = aligned(at + m_header->capacity * sizeof(Slot));
+        m_text = bytes + at;
+    }
+
+    static size_t layout_size(const SharedRingOptions& options) {
+        size_t at = aligned(sizeof(Header));
+        at = aligned(at + options.max_types * sizeof(uint32_t));
+        at = aligned(at + options.names_capacity);
+        at = aligned(at + options.capacity * sizeof(Slot));
+        return at + options.text_capacity;
+    }
+
+    void release() {
+        if (m_memory != nullptr) {
+            munmap(m_memory, m_size);
+        }
+        if (m_owner) {
+            shm_unlink(m_name.c_str());
+        }
+        m_memory = nullptr;
+        m_header = nullptr;
+        m_owner = false;
+    }
+
+    // returns the id of the type, writing its name for the consumer the first time
+    uint64_t type_id(const char *type) {
+        auto found = m_types.find(type);
+        if (found != m_types.end()) {
+            return found->second;
+        }
+        const std::string name = type != nullptr ? type : "";
+        const uint64_t id = m_header->type_count.load(std::memory_order_relaxed);
+        if (id == m_header->max_types || m_header->names_size + name.size() + 1 > m_header->names_capacity) {
+            throw std::length_error("Too many token types for the shared ring " + m_name);
+        }
+        memcpy(m_names + m_header->names_size, name.c_str(), name.size() + 1);
+        m_type_names[id] = static_cast<uint32_t>(m_header->names_size);
+        m_header->names_size += name.size() + 1;
+        m_header->type_count.store(id + 1, std::memory_order_release);
+        m_types.emplace(type, id);
+        return id;
+    }
+
+    // gives the last token read back to the producer (its value is free once the head moved past it)
+    void release_held() {
+        if (!m_holding) {
+            return;
+        }
+        m_header->head.store(m_header->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        m_holding = false;
+    }
+
+    // returns true if the process of the pid is gone, and then cancels the ring for both sides
+    bool gone(const std::atomic<int64_t>& pid) {
+        const int64_t peer = pid.load(std::memory_order_acquire);
+        if (peer == 0 || kill(static_cast<pid_t>(peer), 0) == 0 || errno != ESRCH) {
+            return false;
+        }
+        cancel();
+        return true;
+    }
+
+public:
+    SharedTokenRing() = default;
+
+    SharedTokenRing(const SharedTokenRing&) = delete;
+    SharedTokenRing& operator=(const SharedTokenRing&) = delete;
+
+    SharedTokenRing(SharedTokenRing&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    SharedTokenRing& operator=(SharedTokenRing&& other) noexcept {
+        if (this != &other) {
+            release();
+            m_name = std::move(other.m_name);
+            m_owner = other.m_owner;
+            m_types = std::move(other.m_types);
+            m_holding = other.m_holding;
+            attach_moved(other);
+            other.m_memory = nullptr;
+            other.m_header = nullptr;
+            other.m_owner = false;
+        }
+        return *this;
+    }
+
+    ~SharedTokenRing() {
+        release();
+    }
+
+    // makes the ring under the name (like "/toks-worker-1"), replacing one left by a previous producer
+    static SharedTokenRing create(const std::string& name, const SharedRingOptions& options = SharedRingOptions()) {
+        SharedRingOptions layout = options;
+        size_t capacity = 1;
+        while (capacity < std::max<size_t>(options.capacity, 1)) {
+            capacity <<= 1;
+        }
+        layout.capacity = capacity;
+        layout.text_capacity = std::max<size_t>(options.text_capacity, 1);
+        layout.max_types = std::max<size_t>(options.max_types, 1);
+        const size_t size = layout_size(layout);
+
+        shm_unlink(name.c_str());
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not create the shared memory " + name);
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            const int error = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            throw std::system_error(error, std::generic_category(), "Could not size the shared memory " + name);
+        }
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            const int error = errno;
+            shm_unlink(name.c_str());
+            throw std::system_error(error, std::generic_category(), "Could not map the shared memory " + name);
+        }
+
+        // (the memory is zeroed by ftruncate, the atomics start at 0)
+        auto header = new (memory) Header();
+        header->capacity = layout.capacity;
+        header->text_capacity = layout.text_capacity;
+        header->names_capacity = layout.names_capacity;
+        header->max_types = layout.max_types;
+        header->size = size;
+        header->producer.store(static_cast<int64_t>(getpid()), std::memory_order_relaxed);
+        SharedTokenRing ring;
+        ring.m_name = name;
+        ring.m_owner = true;
+        ring.attach(memory, size);
+        // the magic last, a consumer opening the ring before it is set gives up
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, "TOKRING2", 8);
+        return ring;
+    }
+
+    // opens the ring made by a producer under the name, throws if there is none
+    static SharedTokenRing open(const std::string& name) {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not open the shared memory " + name);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+            ::close(fd);
+            throw std::runtime_error("Invalid shared token ring " + name);
+        }
+        const size_t size = static_cast<size_t>(info.st_size);
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "Could not map the shared memory " + name);
+        }
+        auto header = static_cast<Header *>(memory);
+        SharedRingOptions layout;
+        layout.capacity = static_cast<size_t>(header->capacity);
+        layout.text_capacity = static_cast<size_t>(header->text_capacity);
+        layout.names_capacity = static_cast<size_t>(header->names_capacity);
+        layout.max_types = static_cast<size_t>(header->max_types);
+        if (memcmp(header->magic, "TOKRING2", 8) != 0 || header->size != size || layout.capacity == 0
+            || (layout.capacity & (layout.capacity - 1)) != 0 || layout.text_capacity == 0 || layout.max_types == 0
+            || layout_size(layout) != size) {
+            munmap(memory, size);
+            throw std::runtime_error("Invalid shared token ring " + name);
+        }
+        header->consumer.store(static_cast<int64_t>(getpid()), std::memory_order_release);
+        SharedTokenRing ring;
+        ring.m_name = name;
+        ring.attach(memory, size);
+        return ring;
+    }
+
+    const std::string& name() const {
+        return m_name;
+    }
+
+    // returns the text position of the oldest value the consumer has not released (value when there is none)
+    // (the slots are only written by the producer, the one of the head stays until the head moves)
+    uint64_t oldest_value(uint64_t tail, uint64_t value) const {
+        const uint64_t head = m_header->head.load(std::memory_order_acquire);
+        return head == tail ? value : m_slots[head & (m_header->capacity - 1)].value;
+    }
+
+    // writes a token, waiting while the ring is full (producer)
+    // returns false if the ring was cancelled, or if the consumer process is gone
+    bool push(const TokenInfo& token) {
+        Header& h = *m_header;
+        const uint64_t length = token.value.size();
+        if (length > h.text_capacity) {
+            throw std::length_error("A token value is longer than the text of the shared ring " + m_name);
+        }
+        const uint64_t type = type_id(token.token_type);
+        const uint64_t tail = h.tail.load(std::memory_order_relaxed);
+        uint64_t value = h.text_tail.load(std::memory_order_relaxed);
+        // a value does not wrap around the end of the text, it starts over at its beginning
+        // (the padding is free again once the values before it are released, which the ring empty allows for any value)
+        if (value % h.text_capacity + length > h.text_capacity) {
+            value += h.text_capacity - value % h.text_capacity;
+        }
+        unsigned waits = 0;
+        for (detail::Backoff backoff; tail - h.head.load(std::memory_order_acquire) == h.capacity
+             || value + length - oldest_value(tail, value) > h.text_capacity; backoff.wait()) {
+            if (h.cancelled.load(std::memory_order_acquire) != 0) {
+                return false;
+            }
+            if (++waits % peer_check_interval == 0 && gone(h.consumer)) {
+                return false;
+            }
+        }
+        memcpy(m_text + value % h.text_capacity, token.value.data(), length);
+        m_slots[tail & (h.capacity - 1)] = Slot{token.offset, token.line, token.column, value, length, type};
+        h.text_tail.store(value + length, std::memory_order_relaxed);
+        h.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // reads the next token in place, waiting while the ring is empty (consumer)
+    // The view is valid until the next call. Returns false once the ring is closed and drained, or cancelled,
+    // or if the producer process is gone.
+    bool next(View& view) {
+        release_held();
+        Header& h = *m_header;
+        const uint64_t head = h.head.load(std::memory_order_relaxed);
+        unsigned waits = 0;
+        for (detail::Backoff backoff; head == h.tail.load(std::memory_order_acquire); backoff.wait()) {
+            if (h.cancelled.load(std::memory_order_acquire) != 0) {
+                return false;
+            }
+            if (h.closed.load(std::memory_order_acquire) != 0 && head == h.tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (++waits % peer_check_interval == 0 && gone(h.producer)) {
+                return false;
+            }
+        }
+        const Slot& slot = m_slots[head & (h.capacity - 1)];
+        view.type = m_names + m_type_names[slot.type];
+        view.value = std::string_view(m_text + slot.value % h.text_capacity, static_cast<size_t>(slot.length));
+        view.offset = static_cast<size_t>(slot.offset);
+        view.line = static_cast<size_t>(slot.line);
+        view.column = static_cast<size_t>(slot.column);
+        m_holding = true;
+        return true;
+    }
+
+    // no more tokens will be pushed (producer)
+    void close() {
+        m_header->closed.store(1, std::memory_order_release);
+    }
+
+    // makes push and next give up (either side)
+    void cancel() {
+        m_header->cancelled.store(1, std::memory_order_release);
+    }
+
+private:
+    void attach_moved(SharedTokenRing& other) {
+        m_memory = other.m_memory;
+        m_size = other.m_size;
+        m_header = other.m_header;
+        m_type_names = other.m_type_names;
+        m_names = other.m_names;
+        m_slots = other.m_slots;
+        m_text = other.m_text;
+    }
+};
+
+inline bool Tokenizer::tokenize(const std::string& str, SharedTokenRing& ring, bool allow_default_identifiers) const {
+    std::string normalized;
+    std::vector<TokenInfo> batch;
+    bool pushed = true;
+    lex_slices(normalized_source(str, normalized), allow_default_identifiers, batch, detail::LexRecord(), [&]() {
+        for (auto& token : batch) {
+            if (!ring.push(token)) {
+                pushed = false;
+                return false;
+            }
+        }
+        batch.clear();
+        return true;
+    });
+    return pushed;
+}
+
+#endif
+
+inline void EncodedTokens::use_types_of(const Tokenizer& tokenizer) {
+    resolve_types();
+    for (auto& type : m_types) {
+        for (auto& parser : tokenizer.parsers()) {
+            if (parser->token_type() != nullptr && strcmp(parser->token_type(), type) == 0) {
+                type = parser->token_type();
+                break;
+            }
+        }
+        if (tokenizer.default_type() != nullptr && strcmp(tokenizer.default_type(), type) == 0) {
+            type = tokenizer.default_type();
+        }
+    }
+}
+
+inline uint64_t Tokenizer::fingerprint() const {
+    std::string description = "toks " + std::to_string(TokenCache::version) + "\n";
+    for (auto& parser : m_representations) {
+        description += parser->parser_type();
+        description += '\0';
+        description += parser->token_type() != nullptr ? parser->token_type() : "";
+        description += '\0';
+        description += parser->describe();
+        description += '\0';
+        if (auto pair = dynamic_cast<const TokenBeginEndPair *>(parser.get())) {
+            description += pair->keep_begin() ? '1' : '0';
+            description += pair->keep_end() ? '1' : '0';
+        }
+        description += parser->mode() + '\0' + parser->pushed_mode() + '\0';
+        description += parser->pushes_mode() ? '1' : '0';
+        description += parser->pops_mode() ? '1' : '0';
+        description += '\n';
+    }
+    description += m_default_type != nullptr ? m_default_type : "";
+    description += m_default_as_words ? "\nwords" : "\nuntil parser match";
+    return detail::hash_bytes(description.data(), description.size());
+}
+
+inline TokenCache Tokenizer::load_or_tokenize(const std::string& path, const TokenCacheOptions& options) const {
+    const std::string cache_path = options.cache_path.empty() ? path + ".toks" : options.cache_path;
+    uint64_t source_size = 0;
+    int64_t source_modified = -1;
+    const bool stamped = detail::file_stamp(path, source_size, source_modified);
+
+    TokenCache cache;
+    bool cached = false;
+    try {
+        cache = TokenCache::open(cache_path, this);
+        // (the tokens are checked before the cache is trusted, a damaged file is rebuilt)
+        cached = cache.header().grammar == fingerprint() && cache.verify();
+    } catch (const std::runtime_error&) {
+        // no cache, or not a cache
+    }
+    if (cached && options.trust_timestamp && stamped && cache.header().source_size == source_size
+        && cache.header().source_modified == source_modified) {
+        return cache;
+    }
+
+    std::string source = TokenPipeline::read_file(path);
+    const uint64_t source_hash = detail::hash_bytes(source.data(), source.size());
+    if (cached && cache.header().source_hash == source_hash && cache.header().source_size == source.size()) {
+        if (stamped && options.trust_timestamp && cache.header().source_modified != source_modified) {
+            // the source was only touched, the next load trusts its new time
+            // (a new file, the current one may be mapped by this cache and by other processes)
+            std::string bytes(cache.data(), cache.file_size());
+            TokenCache::Header header = cache.header();
+            header.source_modified = source_modified;
+            memcpy(&bytes[0], &header, sizeof(header));
+            detail::write_file_atomically(cache_path, bytes.data(), bytes.size());
+        }
+        return cache;
+    }
+
+    const uint64_t raw_size = source.size();
+    FileTokenStream::normalize(source);
+    auto tokens = tokenize(source);
+    cache = TokenCache::build(*this, tokens, source, source_hash, raw_size, stamped ? source_modified : -1);
+    detail::write_file_atomically(cache_path, cache.data(), cache.file_size());
+    return cache;
 }
 
 using Toks = Tokenizer;
@@ -0,0 +1,465 @@
+// Throughput benchmark of hl::Tokenizer::tokenize against a hand-written lexer
+//
+// Build: g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+// Usage: ./bench [--size MiB] [--runs N] [--filter substring] [--json file]
+//
+// Every case tokenizes a generated input and reports MB/s and tokens/s (the best of the runs),
+// along with the same numbers for a hand-written lexer of the same input (which must emit as many tokens,
+// the benchmark fails otherwise). The hardware counters
+// of the best run (cycles, instructions, branch and cache misses, see perf_counters.hpp) are
+// reported per byte and per token when the machine allows reading them. The results are written
+// as JSON to stdout (or to --json), and as a table to stderr.
+
+#include "inputs.hpp"
+#include "perf_counters.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bench {
+
+// A token of the baseline lexers (the same work as a TokenInfo: a copied value and a position)
+struct Token {
+    const char *type;
+    std::string value;
+    size_t line;
+    size_t column;
+};
+
+// The hand-written lexers: what one would write for the grammar without the library
+
+// a lexer of the README grammar that follows the rules of the library, so that both emit the same tokens:
+// - the parsers are tried in the order of add_js_grammar (the longest first), and a keyword also matches
+//   the start of a longer word ("in" in "index")
+// - the values of the pairs are kept without their delimiters, a pair without its end does not match
+// - a default identifier runs up to a whitespace, or in until_parser_match mode up to where a parser matches
+class BaselineLexer {
+private:
+    // a keyword (without an end), or a pair
+    struct Entry {
+        std::string value;
+        std::string end;
+        const char *type;
+    };
+    // the keywords and pairs starting with each byte, in the order the library tries them
+    std::vector<Entry> m_entries[256];
+    // the numbers, the line comments and the identifiers of the regexes
+    bool m_regexes;
+    // the default identifiers are words (see Tokenizer::set_default_as_words)
+    bool m_words;
+
+    static bool is_whitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_identifier_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    // returns the end of the characters matching is_allowed from pos
+    template<typename F>
+    static size_t skip(const std::string& str, size_t pos, F&& is_allowed) {
+        for (; pos < str.size() && is_allowed(str[pos]); ++pos);
+        return pos;
+    }
+
+    // returns the end of the number of the regexes at the digit at pos (Float, Hex, Octal, Binary then Integer)
+    static size_t number(const std::string& str, size_t pos, const char *& type) {
+        const size_t digits = skip(str, pos, is_digit);
+        if (digits < str.size() && str[digits] == '.') {
+            const size_t fraction = skip(str, digits + 1, is_digit);
+            if (fraction != digits + 1) {
+                type = "Float_Literal";
+                return fraction;
+            }
+        }
+        if (str[pos] == '0' && pos + 1 < str.size()) {
+            const char kind = str[pos + 1];
+            size_t end = pos + 2;
+            if (kind == 'x') {
+                type = "Hex_Literal";
+                end = skip(str, end, [](char c) {
+                    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+                });
+            } else if (kind == 'o') {
+                type = "Octal_Literal";
+                end = skip(str, end, [](char c) { return c >= '0' && c <= '7'; });
+            } else if (kind == 'b') {
+                type = "Binary_Literal";
+                end = skip(str, end, [](char c) { return c == '0' || c == '1'; });
+            }
+            if (end > pos + 2) {
+                return end;
+            }
+        }
+        type = "Integer_Literal";
+        return digits;
+    }
+
+public:
+    BaselineLexer(bool with_regexes, bool as_words)
+        : m_regexes(with_regexes)
+        , m_words(as_words)
+    {
+        // (the same order as add_js_grammar, the multiline comments first)
+        m_entries[static_cast<unsigned char>('/')].push_back(Entry{"/*", "*/", "Comment"});
+        auto values = js_grammar();
+        std::stable_sort(values.begin(), values.end(), [](const GrammarEntry& a, const GrammarEntry& b) {
+            return strlen(a.value) > strlen(b.value);
+        });
+        for (auto& v : values) {
+            if (v.type != Regex) {
+                m_entries[static_cast<unsigned char>(v.value[0])].push_back(
+                    Entry{v.value, v.type == BEPair ? v.value : "", v.name});
+            }
+        }
+    }
+
+    std::vector<Token> tokenize(const std::string& str) const {
+        std::vector<Token> tokens;
+        size_t pos = 0;
+        size_t line = 0;
+        size_t line_start = 0;
+        const size_t size = str.size();
+        auto emit = [&](const char *type, size_t begin, size_t end) {
+            tokens.push_back(Token{type, str.substr(begin, end - begin), line, begin - line_start});
+        };
+        auto skip_to = [&](size_t end) {
+            for (size_t i = pos; i < end; ++i) {
+                if (str[i] == '\n') {
+                    ++line;
+                    line_start = i + 1;
+                }
+            }
+            pos = end;
+        };
+        // a parser may start with the byte
+        auto candidate = [&](char c) {
+            return m_regexes || !m_entries[static_cast<unsigned char>(c)].empty();
+        };
+        // emits the token starting at pos and moves past it, returns false if nothing matches
+        auto match = [&]() {
+            const char c = str[pos];
+            const char *type = nullptr;
+            if (m_regexes && is_digit(c)) {
+                // (no keyword starts with a digit)
+                const size_t end = number(str, pos, type);
+                emit(type, pos, end);
+                pos = end;
+                return true;
+            }
+            if (m_regexes && (c == '#' || (c == '/' && pos + 1 < size && str[pos + 1] == '/'))) {
+                // (the line comments are tried after "/*" and before the keywords starting with '/')
+                size_t end = pos;
+                for (; end < size && str[end] != '\n' && str[end] != '\r'; ++end);
+                emit("Comment", pos, end);
+                pos = end;
+                return true;
+            }
+            for (auto& entry : m_entries[static_cast<unsigned char>(c)]) {
+                if (str.compare(pos, entry.value.size(), entry.value) != 0) {
+                    continue;
+                }
+                if (entry.end.empty()) {
+                    emit(entry.type, pos, pos + entry.value.size());
+                    pos += entry.value.size();
+                    return true;
+                }
+                const size_t close = str.find(entry.end, pos + entry.value.size());
+                if (close == std::string::npos) {
+                    continue;
+                }
+                const size_t begin = pos + entry.value.size();
+                tokens.push_back(Token{entry.type, str.substr(begin, close - begin), line, pos - line_start});
+                skip_to(close + entry.end.size());
+                return true;
+            }
+            if (m_regexes && is_identifier_start(c)) {
+                const size_t end = skip(str, pos + 1, [](char c) { return is_identifier_start(c) || is_digit(c); });
+                emit("Identifier", pos, end);
+                pos = end;
+                return true;
+            }
+            return false;
+        };
+
+        while (pos < size) {
+            if (is_whitespace(str[pos])) {
+                skip_to(pos + 1);
+                continue;
+            }
+            if (match()) {
+                continue;
+            }
+            if (m_regexes) {
+                throw std::runtime_error("The baseline lexer found no token at line " + std::to_string(line + 1));
+            }
+            const size_t begin = pos;
+            if (m_words) {
+                pos = skip(str, pos, [](char c) { return !is_whitespace(c); });
+                emit("Identifier", begin, pos);
+                continue;
+            }
+            // up to the next whitespace, or the identifier goes before the token a parser matches
+            Token identifier{"Identifier", std::string(), line, begin - line_start};
+            const size_t count = tokens.size();
+            size_t end = begin;
+            while (end < size && !is_whitespace(str[end])) {
+                end = skip(str, end + 1, [&](char c) { return !is_whitespace(c) && !candidate(c); });
+                pos = end;
+                if (end < size && !is_whitespace(str[end]) && match()) {
+                    break;
+                }
+            }
+            identifier.value = str.substr(begin, end - begin);
+            tokens.insert(tokens.begin() + count, std::move(identifier));
+        }
+        return tokens;
+    }
+};
+
+// splits on whitespace
+std::vector<Token> baseline_words(const std::string& str) {
+    std::vector<Token> tokens;
+    size_t line = 0;
+    size_t line_start = 0;
+    size_t pos = 0;
+    while (pos < str.size()) {
+        const char c = str[pos];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (c == '\n') {
+                ++line;
+                line_start = pos + 1;
+            }
+            ++pos;
+            continue;
+        }
+        size_t end = pos;
+        while (end < str.size() && str[end] != ' ' && str[end] != '\t' && str[end] != '\r' && str[end] != '\n') {
+            ++end;
+        }
+        tokens.push_back(Token{"Word", str.substr(pos, end - pos), line, pos - line_start});
+        pos = end;
+    }
+    return tokens;
+}
+
+// The cases
+
+struct Case {
+    const char *name;
+    const char *description;
+    std::function<std::string(size_t, uint32_t)> input;
+    std::function<void(hl::Toks&)> grammar;
+    bool allow_default_identifiers;
+    std::function<size_t(const std::string&)> baseline; // returns the number of tokens
+    size_t max_size = std::numeric_limits<size_t>::max(); // caps --size
+};
+
+struct Measure {
+    double seconds = 0; // the best run
+    size_t tokens = 0;
+    PerfCounters::Values counters; // of the best run
+};
+
+template<typename F>
+Measure measure(size_t runs, PerfCounters& counters, F&& run) {
+    Measure best;
+    best.seconds = 1e300;
+    for (size_t i = 0; i < runs; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        counters.start();
+        const size_t tokens = run();
+        const auto values = counters.stop();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds < best.seconds) {
+            best.seconds = seconds;
+            best.counters = values;
+        }
+        best.tokens = tokens;
+    }
+    return best;
+}
+
+// the counters as a JSON object (null for the unavailable ones)
+std::string counters_json(const Measure& measure, size_t bytes, const std::string& indent) {
+    std::ostringstream out;
+    const auto& c = measure.counters;
+    out << "{";
+    for (int i = 0; i < PerfCounters::Count; ++i) {
+        out << (i == 0 ? "\n" : ",\n") << indent << "  \"" << PerfCounters::name(i) << "\": ";
+        if (!c.available[i]) {
+            out << "null";
+            continue;
+        }
+        out << "{\"total\": " << c.value[i] << ", \"per_byte\": " << c.value[i] / static_cast<double>(bytes)
+            << ", \"per_token\": " << c.value[i] / static_cast<double>(std::max<size_t>(measure.tokens, 1)) << "}";
+    }
+    out << ",\n" << indent << "  \"ipc\": ";
+    if (c.available[PerfCounters::Cycles] && c.available[PerfCounters::Instructions] && c.value[PerfCounters::Cycles] > 0) {
+        out << c.value[PerfCounters::Instructions] / c.value[PerfCounters::Cycles];
+    } else {
+        out << "null";
+    }
+    out << "\n" << indent << "}";
+    return out.str();
+}
+
+std::vector<Case> cases() {
+    static const BaselineLexer full(true, true), keywords(false, true), until_parser_match(false, false);
+    auto readme = [](const BaselineLexer& baseline) {
+        return [&baseline](const std::string& str) { return baseline.tokenize(str).size(); };
+    };
+    auto words = [](const std::string& str) { return baseline_words(str).size(); };
+
+    return {
+        // (its regexes are anchored, see add_js_grammar)
+        { "js_full_grammar", "the README grammar (with its regexes) over JS-like source",
+          js_source, [](hl::Toks& t) { add_js_grammar(t, true); }, false, readme(full) },
+        { "js_keywords", "the keywords, pairs and operators of the README grammar, default identifiers",
+          js_source, [](hl::Toks& t) { add_js_grammar(t, false); }, true, readme(keywords) },
+        { "js_until_parser_match", "js_keywords in until_parser_match mode",
+          js_source, [](hl::Toks& t) { add_js_grammar(t, false); t.set_default_as_until_parser_match(); }, true,
+          readme(until_parser_match) },
+        { "comments_strings", "comment and string heavy source, js_keywords grammar",
+          comment_string_source, [](hl::Toks& t) { add_js_grammar(t, false); }, true, readme(keywords) },
+        { "log_words", "server logs split by whitespace (no parser)",
+          log_source, [](hl::Toks& t) { t.set_default_type("Word"); }, true, words },
+        { "log_words_indexed", "log_words with the structural index",
+          log_source, [](hl::Toks& t) { t.set_default_type("Word"); t.set_structural_index(); }, true, words },
+    };
+}
+
+std::string json_escape(const std::string& str) {
+    std::string out;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+} // namespace bench
+
+int main(int argc, char **argv) {
+    size_t size = 8 << 20;
+    size_t runs = 5;
+    std::string filter;
+    std::string json_path;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            size = static_cast<size_t>(std::stod(argv[++i]) * (1 << 20));
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--size MiB] [--runs N] [--filter substring] [--json file]\n";
+            return 2;
+        }
+    }
+
+    bench::PerfCounters counters;
+    if (!counters.any()) {
+        fprintf(stderr, "(the hardware counters are not available)\n");
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"size\": " << size << ",\n  \"runs\": " << runs << ",\n  \"cases\": [";
+    fprintf(stderr, "%-24s %10s %12s %12s %12s %8s %8s %6s\n", "case", "tokens", "MB/s", "Mtokens/s", "baseline MB/s",
+            "ratio", "cycles/B", "IPC");
+
+    bool first = true;
+    for (auto& c : bench::cases()) {
+        if (!filter.empty() && std::string(c.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        const std::string input = c.input(std::min(size, c.max_size), 42);
+        hl::Toks tokenizer;
+        c.grammar(tokenizer);
+
+        // the ratio only compares the same work, the two must emit the same tokens
+        const size_t expected = tokenizer.tokenize(input, c.allow_default_identifiers).size();
+        const size_t baseline_tokens = c.baseline(input);
+        if (expected != baseline_tokens) {
+            fprintf(stderr, "%s: the library emits %zu tokens and the baseline %zu\n", c.name, expected,
+                    baseline_tokens);
+            return 1;
+        }
+
+        const auto toks = bench::measure(runs, counters, [&]() {
+            return tokenizer.tokenize(input, c.allow_default_identifiers).size();
+        });
+        const auto baseline = bench::measure(runs, counters, [&]() {
+            return c.baseline(input);
+        });
+
+        const double mb = static_cast<double>(input.size()) / 1e6;
+        const double mb_per_s = mb / toks.seconds;
+        const double tokens_per_s = static_cast<double>(toks.tokens) / toks.seconds;
+        const double baseline_mb_per_s = mb / baseline.seconds;
+        const double baseline_tokens_per_s = static_cast<double>(baseline.tokens) / baseline.seconds;
+
+        const auto& values = toks.counters;
+        char cycles_per_byte[32] = "-";
+        char ipc[32] = "-";
+        if (values.available[bench::PerfCounters::Cycles]) {
+            snprintf(cycles_per_byte, sizeof(cycles_per_byte), "%.2f",
+                     values.value[bench::PerfCounters::Cycles] / static_cast<double>(input.size()));
+            if (values.available[bench::PerfCounters::Instructions] && values.value[bench::PerfCounters::Cycles] > 0) {
+                snprintf(ipc, sizeof(ipc), "%.2f",
+                         values.value[bench::PerfCounters::Instructions] / values.value[bench::PerfCounters::Cycles]);
+            }
+        }
+        fprintf(stderr, "%-24s %10zu %12.1f %12.2f %12.1f %8.2f %8s %6s\n", c.name, toks.tokens, mb_per_s,
+                tokens_per_s / 1e6, baseline_mb_per_s, mb_per_s / baseline_mb_per_s, cycles_per_byte, ipc);
+
+        json << (first ? "" : ",") << "\n    {\n"
+             << "      \"name\": \"" << c.name << "\",\n"
+             << "      \"description\": \"" << bench::json_escape(c.description) << "\",\n"
+             << "      \"bytes\": " << input.size() << ",\n"
+             << "      \"tokens\": " << toks.tokens << ",\n"
+             << "      \"seconds\": " << toks.seconds << ",\n"
+             << "      \"mb_per_s\": " << mb_per_s << ",\n"
+             << "      \"tokens_per_s\": " << tokens_per_s << ",\n"
+             << "      \"counters\": " << bench::counters_json(toks, input.size(), "      ") << ",\n"
+             << "      \"baseline\": {\n"
+             << "        \"tokens\": " << baseline.tokens << ",\n"
+             << "        \"seconds\": " << baseline.seconds << ",\n"
+             << "        \"mb_per_s\": " << baseline_mb_per_s << ",\n"
+             << "        \"tokens_per_s\": " << baseline_tokens_per_s << ",\n"
+             << "        \"counters\": " << bench::counters_json(baseline, input.size(), "        ") << "\n"
+             << "      },\n"
+             << "      \"ratio_to_baseline\": " << mb_per_s / baseline_mb_per_s << "\n"
+             << "    }";
+        first = false;
+    }
+    json << "\n  ]\n}\n";
+
+    if (json_path.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(json_path) << json.str();
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Generated inputs for a tokenizer: the shape of the input (the mix of tokens, the density of comments and
+// strings, the length of the lines, ...) is set by a CorpusShape, and the same seed gives the same input.
+
+#pragma once
+
+#include "../Toks.hpp"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// The shape of a generated input (the rates are probabilities from 0 to 1)
+struct CorpusShape {
+    // the relative weights of the kinds of tokens
+    double keyword_weight = 4; // the keywords of the tokenizer
+    double word_weight = 4;    // words that are not keywords (default identifiers)
+    double number_weight = 1;
+    double comment_weight = 0.5; // the pairs whose begin and end differ, like /* */
+    double string_weight = 0.5;  // the pairs whose begin and end are the same, like ""
+
+    size_t line_length = 80;       // the average length of a line
+    size_t word_length = 6;        // the average length of a word
+    size_t pair_content_words = 8; // the average number of words inside a comment or a string
+    double crlf_rate = 0;          // the lines ending with \r\n
+    double unterminated_rate = 0;  // the comments and strings that are not closed
+    // the lines that are a long run of one character without a separator, where the regexes
+    // that backtrack or search ahead slow down
+    double pathological_rate = 0;
+    size_t pathological_length = 4096;
+};
+
+// Generates inputs made of the keywords and pairs registered in a tokenizer
+class CorpusGenerator {
+private:
+    CorpusShape m_shape;
+    std::mt19937_64 m_random;
+    std::vector<std::string> m_keywords;
+    std::vector<std::pair<std::string, std::string>> m_comments;
+    std::vector<std::pair<std::string, std::string>> m_strings;
+    std::discrete_distribution<int> m_kinds;
+
+    enum Kind { Keyword, Word, Number, Comment, String };
+
+    size_t around(size_t average) {
+        return 1 + m_random() % (2 * std::max<size_t>(average, 1));
+    }
+
+    void word(std::string& out) {
+        static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+        for (size_t i = around(m_shape.word_length); i > 0; --i) {
+            out += letters[m_random() % (sizeof(letters) - 1)];
+        }
+    }
+
+    bool chance(double rate) {
+        return rate > 0 && std::uniform_real_distribution<double>(0, 1)(m_random) < rate;
+    }
+
+    void pair(std::string& out, const std::pair<std::string, std::string>& delimiters) {
+        out += delimiters.first;
+        for (size_t i = around(m_shape.pair_content_words); i > 0; --i) {
+            word(out);
+            out += ' ';
+        }
+        if (!chance(m_shape.unterminated_rate)) {
+            out += delimiters.second;
+        }
+    }
+
+    void token(std::string& out) {
+        switch (m_kinds(m_random)) {
+            case Keyword: out += m_keywords[m_random() % m_keywords.size()]; break;
+            case Word: word(out); break;
+            case Number: out += std::to_string(m_random() % 100000); break;
+            case Comment: pair(out, m_comments[m_random() % m_comments.size()]); break;
+            case String: pair(out, m_strings[m_random() % m_strings.size()]); break;
+        }
+    }
+
+    void end_line(std::string& out) {
+        out += chance(m_shape.crlf_rate) ? "\r\n" : "\n";
+    }
+
+public:
+    CorpusGenerator(const hl::Tokenizer& tokenizer, const CorpusShape& shape = CorpusShape(), uint64_t seed = 1)
+        : m_shape(shape)
+        , m_random(seed)
+    {
+        for (auto& parser : tokenizer.parsers()) {
+            if (auto keyword = dynamic_cast<const hl::TokenKeyword *>(parser.get())) {
+                m_keywords.push_back(keyword->keyword());
+            } else if (auto pair = dynamic_cast<const hl::TokenBeginEndPair *>(parser.get())) {
+                if (pair->begin().empty() || pair->end().empty()) {
+                    continue;
+                }
+                (pair->begin() == pair->end() ? m_strings : m_comments).emplace_back(pair->begin(), pair->end());
+            }
+        }
+        // the kinds without a parser are not generated
+        m_kinds = std::discrete_distribution<int>({
+            m_keywords.empty() ? 0 : m_shape.keyword_weight,
+            m_shape.word_weight,
+            m_shape.number_weight,
+            m_comments.empty() ? 0 : m_shape.comment_weight,
+            m_strings.empty() ? 0 : m_shape.string_weight,
+        });
+    }
+
+    // appends about size bytes (whole lines) to out
+    void generate(size_t size, std::string& out) {
+        const size_t end = out.size() + size;
+        while (out.size() < end) {
+            if (chance(m_shape.pathological_rate)) {
+                out.append(around(m_shape.pathological_length), static_cast<char>('a' + m_random() % 26));
+                end_line(out);
+                continue;
+            }
+            const size_t line_end = out.size() + around(m_shape.line_length);
+            while (out.size() < line_end) {
+                token(out);
+                out += ' ';
+            }
+            end_line(out);
+        }
+    }
+
+    std::string generate(size_t size) {
+        std::string out;
+        out.reserve(size + 2 * m_shape.line_length);
+        generate(size, out);
+        return out;
+    }
+};
+
+} // namespace bench
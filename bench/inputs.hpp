@@ -0,0 +1,217 @@
+// The grammar and the generated inputs of the benchmarks
+
+#pragma once
+
+#include "../Toks.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// The grammar of the "Tokenizing a full language" README example
+struct GrammarEntry { const char *name; const char *value; int type; };
+enum { Keyword, BEPair, Regex };
+
+inline const std::vector<GrammarEntry>& js_grammar() {
+    static const std::vector<GrammarEntry> values {
+        { "If_Keyword", "if", Keyword }, { "Else_Keyword", "else", Keyword },
+        { "Return_Keyword", "return", Keyword }, { "While_Keyword", "while", Keyword },
+        { "For_Keyword", "for", Keyword }, { "In_Keyword", "in", Keyword },
+        { "Break_Keyword", "break", Keyword }, { "Continue_Keyword", "continue", Keyword },
+        { "Function_Keyword", "function", Keyword }, { "Class_Keyword", "class", Keyword },
+        { "New_Keyword", "new", Keyword }, { "This_Keyword", "this", Keyword },
+        { "Super_Keyword", "super", Keyword }, { "Import_Keyword", "import", Keyword },
+        { "From_Keyword", "from", Keyword }, { "As_Keyword", "as", Keyword },
+        { "Try_Keyword", "try", Keyword }, { "Catch_Keyword", "catch", Keyword },
+        { "Finally_Keyword", "finally", Keyword }, { "Throw_Keyword", "throw", Keyword },
+        { "Delete_Keyword", "delete", Keyword }, { "Typeof_Keyword", "typeof", Keyword },
+        { "Instanceof_Keyword", "instanceof", Keyword }, { "Var_Keyword", "var", Keyword },
+        { "Let_Keyword", "let", Keyword }, { "Const_Keyword", "const", Keyword },
+        { "Enum_Keyword", "enum", Keyword }, { "Export_Keyword", "export", Keyword },
+        { "Default_Keyword", "default", Keyword }, { "Case_Keyword", "case", Keyword },
+        { "Switch_Keyword", "switch", Keyword }, { "Extends_Keyword", "extends", Keyword },
+        { "Implements_Keyword", "implements", Keyword }, { "Interface_Keyword", "interface", Keyword },
+        { "Package_Keyword", "package", Keyword }, { "Private_Keyword", "private", Keyword },
+        { "Protected_Keyword", "protected", Keyword }, { "Public_Keyword", "public", Keyword },
+        { "Static_Keyword", "static", Keyword }, { "Yield_Keyword", "yield", Keyword },
+        { "Await_Keyword", "await", Keyword }, { "Async_Keyword", "async", Keyword },
+        { "Int_Keyword", "int", Keyword }, { "Float_Keyword", "float", Keyword },
+        { "Double_Keyword", "double", Keyword }, { "Long_Keyword", "long", Keyword },
+        { "Short_Keyword", "short", Keyword }, { "Char_Keyword", "char", Keyword },
+        { "Boolean_Keyword", "boolean", Keyword }, { "Byte_Keyword", "byte", Keyword },
+        { "Void_Keyword", "void", Keyword }, { "Any_Keyword", "any", Keyword },
+        { "String_Keyword", "string", Keyword }, { "Object_Keyword", "object", Keyword },
+        { "Array_Keyword", "array", Keyword }, { "Map_Keyword", "map", Keyword },
+        { "Set_Keyword", "set", Keyword },
+        { "Open_Paren", "(", Keyword }, { "Close_Paren", ")", Keyword },
+        { "Open_Brace", "{", Keyword }, { "Close_Brace", "}", Keyword },
+        { "Open_Bracket", "[", Keyword }, { "Close_Bracket", "]", Keyword },
+        { "String_Literal_Double", "\"", BEPair }, { "String_Literal_Single", "'", BEPair },
+        { "String_Literal_Backtick", "`", BEPair },
+        { "True_Literal", "true", Keyword }, { "False_Literal", "false", Keyword },
+        { "Null_Literal", "null", Keyword }, { "Undefined_Literal", "undefined", Keyword },
+        { "NaN_Literal", "NaN", Keyword }, { "Infinity_Literal", "Infinity", Keyword },
+        { "Integer_Literal", "[0-9]+", Regex }, { "Float_Literal", "[0-9]+\\.[0-9]+", Regex },
+        { "Hex_Literal", "0x[0-9a-fA-F]+", Regex }, { "Binary_Literal", "0b[01]+", Regex },
+        { "Octal_Literal", "0o[0-7]+", Regex },
+        { "Comment", "//.*", Regex }, { "Comment", "#.*", Regex },
+        { "Rotate_Left", "<<<", Keyword }, { "Rotate_Right", ">>>", Keyword },
+        { "Strict_Equal", "===", Keyword }, { "Strict_Not_Equal", "!==", Keyword },
+        { "Left_Shift_Assign", "<<=", Keyword }, { "Right_Shift_Assign", ">>=", Keyword },
+        { "Power_Assign", "**=", Keyword },
+        { "Increment", "++", Keyword }, { "Equal", "==", Keyword }, { "Power", "**", Keyword },
+        { "Decrement", "--", Keyword }, { "Floor_Divide", "//", Keyword },
+        { "Not_Equal", "!=", Keyword }, { "Greater_Equal", ">=", Keyword },
+        { "Less_Equal", "<=", Keyword }, { "And", "&&", Keyword }, { "Or", "||", Keyword },
+        { "Left_Shift", "<<", Keyword }, { "Right_Shift", ">>", Keyword },
+        { "Plus_Assign", "+=", Keyword }, { "Minus_Assign", "-=", Keyword },
+        { "Multiply_Assign", "*=", Keyword }, { "Divide_Assign", "/=", Keyword },
+        { "Modulo_Assign", "%=", Keyword }, { "Bitwise_And_Assign", "&=", Keyword },
+        { "Bitwise_Or_Assign", "|=", Keyword }, { "Bitwise_Xor_Assign", "^=", Keyword },
+        { "Bitwise_Not_Assign", "~=", Keyword }, { "Arrow", "->", Keyword },
+        { "Plus", "+", Keyword }, { "Minus", "-", Keyword }, { "Multiply", "*", Keyword },
+        { "Divide", "/", Keyword }, { "Modulo", "%", Keyword }, { "Assign", "=", Keyword },
+        { "Greater", ">", Keyword }, { "Less", "<", Keyword }, { "Not", "!", Keyword },
+        { "Bitwise_And", "&", Keyword }, { "Bitwise_Or", "|", Keyword },
+        { "Bitwise_Xor", "^", Keyword }, { "Bitwise_Not", "~", Keyword },
+        { "Colon", ":", Keyword }, { "Question", "?", Keyword },
+        { "Semicolon", ";", Keyword }, { "Comma", ",", Keyword }, { "Dot", ".", Keyword }
+    };
+    return values;
+}
+
+// registers the README grammar, sorted by length so that nothing is shadowed
+// (the multiline comments come first, the README adds them last where "/" shadows them)
+// The regexes are anchored with ^: a regex parser searches from the current position, so the README ones
+// match further in the input (like "//.*" for the next comment) where the baseline lexers do not.
+inline void add_js_grammar(hl::Toks& tokenizer, bool with_regexes) {
+    tokenizer.add_begin_end_pair("/*", "*/", false, false, "Comment");
+    auto values = js_grammar();
+    std::stable_sort(values.begin(), values.end(), [](const GrammarEntry& a, const GrammarEntry& b) {
+        return strlen(a.value) > strlen(b.value);
+    });
+    for (auto& v : values) {
+        switch (v.type) {
+            case Keyword: tokenizer.add_keyword(v.value, v.name); break;
+            case BEPair: tokenizer.add_begin_end_pair(v.value, v.value, false, false, v.name); break;
+            case Regex: if (with_regexes) tokenizer.add_regex(std::string("^") + v.value, v.name); break;
+        }
+    }
+    if (with_regexes) {
+        tokenizer.add_regex("^[a-zA-Z_][a-zA-Z0-9_]*", "Identifier");
+    }
+    tokenizer.set_default_type("Identifier");
+}
+
+// The inputs (deterministic for a seed)
+
+inline const char *const identifiers[] = { "value", "index", "result", "node", "count", "buffer", "left", "right",
+                                           "options", "callback", "i", "x", "total", "item", "config" };
+inline const char *const keywords[] = { "if", "else", "return", "while", "for", "function", "const", "let", "new",
+                                        "this", "true", "false", "null", "typeof", "class", "await" };
+inline const char *const operators[] = { "=", "==", "===", "!=", "+", "-", "*", "/", "+=", "&&", "||", "<", ">=",
+                                         "<<", "++", "->", "?", ":", ".", ",", ";", "(", ")", "{", "}", "[", "]" };
+
+template<size_t N>
+const char *pick(std::mt19937& random, const char *const (&values)[N]) {
+    return values[random() % N];
+}
+
+// JS-like source: statements of identifiers, keywords, operators and numbers, with some comments and strings
+inline std::string js_source(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::string out;
+    out.reserve(size + 256);
+    size_t indent = 0;
+    while (out.size() < size) {
+        out.append(indent * 4, ' ');
+        switch (random() % 10) {
+            case 0: out += "// "; out += pick(random, identifiers); out += " is computed below"; break;
+            case 1: out += "/* "; out += pick(random, identifiers); out += " */ "; out += pick(random, identifiers);
+                    out += ";"; break;
+            case 2: if (indent < 6) { out += "if ("; out += pick(random, identifiers); out += " == ";
+                    out += std::to_string(random() % 1000); out += ") {"; ++indent; } break;
+            case 3: if (indent > 0) { --indent; out.resize(out.size() - 4); out += "}"; } break;
+            case 4: out += "const "; out += pick(random, identifiers); out += " = \"";
+                    out += pick(random, identifiers); out += " text\";"; break;
+            default:
+                out += pick(random, identifiers);
+                for (int i = random() % 6; i > 0; --i) {
+                    out += ' ';
+                    out += pick(random, operators);
+                    out += ' ';
+                    switch (random() % 4) {
+                        case 0: out += pick(random, keywords); break;
+                        case 1: out += std::to_string(random() % 100000); break;
+                        default: out += pick(random, identifiers); break;
+                    }
+                }
+                out += ";";
+                break;
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+// mostly comments and strings, with a few statements in between
+inline std::string comment_string_source(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::string out;
+    out.reserve(size + 512);
+    while (out.size() < size) {
+        switch (random() % 4) {
+            case 0: {
+                out += "/*";
+                for (int i = 2 + random() % 12; i > 0; --i) {
+                    out += "\n * ";
+                    out += pick(random, identifiers);
+                    out += " and some words of documentation about it";
+                }
+                out += "\n */\n";
+                break;
+            }
+            case 1: case 2: {
+                out += pick(random, identifiers);
+                out += " = \"";
+                for (int i = 1 + random() % 10; i > 0; --i) {
+                    out += pick(random, identifiers);
+                    out += ' ';
+                }
+                out += "\" + '";
+                out += pick(random, identifiers);
+                out += "';\n";
+                break;
+            }
+            default: out += "call(value, other);\n"; break;
+        }
+    }
+    return out;
+}
+
+// server logs: words separated by spaces
+inline std::string log_source(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    const char *const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    const char *const paths[] = { "/api/v1/users", "/api/v1/items", "/health", "/static/app.js", "/login" };
+    std::string out;
+    out.reserve(size + 256);
+    char line[256];
+    while (out.size() < size) {
+        const int length = snprintf(line, sizeof(line),
+            "2024-03-%02u 12:%02u:%02u.%03u %s [worker-%u] GET %s status=%u bytes=%u time=%ums\n",
+            1 + static_cast<unsigned>(random() % 28), static_cast<unsigned>(random() % 60),
+            static_cast<unsigned>(random() % 60), static_cast<unsigned>(random() % 1000), pick(random, levels),
+            static_cast<unsigned>(random() % 16), pick(random, paths), 200 + static_cast<unsigned>(random() % 4) * 100,
+            static_cast<unsigned>(random() % 65536), static_cast<unsigned>(random() % 500));
+        out.append(line, static_cast<size_t>(length));
+    }
+    return out;
+}
+
+} // namespace bench
@@ -0,0 +1,298 @@
+// Latency distribution of the tokenization of small inputs (like RPC payloads of 50 to 500 bytes)
+//
+// Build: g++ -std=c++17 -O2 -pthread latency.cpp -o latency
+// Usage: ./latency [--calls N] [--filter substring] [--json file]
+//
+// Every case tokenizes the inputs one call at a time and records the duration of each call in a
+// histogram with a bounded relative error (like HdrHistogram), along with the memory allocations of
+// the call (split by their source in the library, see hl::AllocationStats). The percentiles are written
+// as JSON to stdout (or to --json), and as a table to stderr.
+
+#define TOKS_TRACK_ALLOCATIONS
+#include "inputs.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Every allocation of the program is counted
+namespace bench {
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocated_bytes{0};
+} // namespace bench
+
+void *operator new(size_t size) {
+    bench::allocations.fetch_add(1, std::memory_order_relaxed);
+    bench::allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    hl::detail::count_allocation(size);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// (not inlined, where GCC would see a free of a pointer from new)
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace bench {
+
+// Counts values in buckets whose width is at most 1/64 of their values, so that any percentile is
+// known within 1.6% whatever the range (the values are nanoseconds, from 1ns to hours)
+class Histogram {
+private:
+    static constexpr unsigned sub_bits = 7;
+    static constexpr uint64_t sub_count = uint64_t(1) << sub_bits; // the exact values below this
+    static constexpr uint64_t half_count = sub_count / 2;
+
+    std::vector<uint64_t> m_counts = std::vector<uint64_t>(sub_count + (64 - sub_bits) * half_count);
+    uint64_t m_total = 0;
+    uint64_t m_max = 0;
+    double m_sum = 0;
+
+    static size_t index(uint64_t value) {
+        if (value < sub_count) {
+            return static_cast<size_t>(value);
+        }
+        // value >> shift is in [half_count, sub_count)
+        const unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - (sub_bits - 1);
+        return static_cast<size_t>(sub_count + (shift - 1) * half_count + ((value >> shift) - half_count));
+    }
+
+    // returns the largest value counted in the bucket
+    static uint64_t highest(size_t index) {
+        if (index < sub_count) {
+            return index;
+        }
+        const unsigned shift = static_cast<unsigned>((index - sub_count) / half_count) + 1;
+        const uint64_t sub = (index - sub_count) % half_count + half_count;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(uint64_t value) {
+        ++m_counts[index(value)];
+        ++m_total;
+        m_sum += static_cast<double>(value);
+        if (value > m_max) {
+            m_max = value;
+        }
+    }
+
+    // returns the value below which (or at which) the given fraction of the values are
+    uint64_t percentile(double fraction) const {
+        if (m_total == 0) {
+            return 0;
+        }
+        const auto rank = static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(m_total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            seen += m_counts[i];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return std::min(highest(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t count() const {
+        return m_total;
+    }
+
+    uint64_t max() const {
+        return m_max;
+    }
+
+    double mean() const {
+        return m_total == 0 ? 0 : m_sum / static_cast<double>(m_total);
+    }
+};
+
+// the small inputs: JS-like source cut at a size between 50 and 500 bytes
+std::vector<std::string> payloads(size_t count, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<std::string> out;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t size = 50 + random() % 451;
+        std::string payload = js_source(size, static_cast<uint32_t>(random()));
+        payload.resize(size);
+        out.push_back(std::move(payload));
+    }
+    return out;
+}
+
+struct Case {
+    const char *name;
+    const char *description;
+    // returns a function that tokenizes an input and returns the number of tokens
+    std::function<std::function<size_t(const std::string&)>()> setup;
+    size_t calls_divisor = 1; // for the slow cases
+};
+
+std::vector<Case> cases() {
+    return {
+        { "tokenize", "a reused tokenizer (keywords of the README grammar), a new vector of tokens for every call",
+          []() -> std::function<size_t(const std::string&)> {
+              auto tokenizer = std::make_shared<hl::Toks>();
+              add_js_grammar(*tokenizer, false);
+              return [tokenizer](const std::string& input) { return tokenizer->tokenize(input).size(); };
+          } },
+        { "tokenize_context", "tokenize with a reused TokenizerContext",
+          []() -> std::function<size_t(const std::string&)> {
+              auto tokenizer = std::make_shared<hl::Toks>();
+              auto context = std::make_shared<hl::TokenizerContext>();
+              add_js_grammar(*tokenizer, false);
+              return [tokenizer, context](const std::string& input) {
+                  return tokenizer->tokenize(input, *context).size();
+              };
+          } },
+        { "stream_copy", "a FileTokenStream copying the input for every call, a reused vector of tokens",
+          []() -> std::function<size_t(const std::string&)> {
+              auto tokenizer = std::make_shared<hl::Toks>();
+              auto tokens = std::make_shared<std::vector<hl::TokenInfo>>();
+              add_js_grammar(*tokenizer, false);
+              return [tokenizer, tokens](const std::string& input) {
+                  hl::FileTokenStream stream(input);
+                  tokens->clear();
+                  tokenizer->tokenize_stream(stream, *tokens);
+                  return tokens->size();
+              };
+          } },
+        { "full_grammar", "tokenize with the README grammar and its regexes",
+          []() -> std::function<size_t(const std::string&)> {
+              auto tokenizer = std::make_shared<hl::Toks>();
+              add_js_grammar(*tokenizer, true);
+              return [tokenizer](const std::string& input) { return tokenizer->tokenize(input).size(); };
+          }, 10 },
+        { "new_tokenizer", "a tokenizer constructed and set up for every call",
+          []() -> std::function<size_t(const std::string&)> {
+              return [](const std::string& input) {
+                  hl::Toks tokenizer;
+                  add_js_grammar(tokenizer, false);
+                  return tokenizer.tokenize(input).size();
+              };
+          }, 100 },
+    };
+}
+
+} // namespace bench
+
+int main(int argc, char **argv) {
+    size_t calls = 1000000;
+    std::string filter;
+    std::string json_path;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--calls" && i + 1 < argc) {
+            calls = std::stoull(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--calls N] [--filter substring] [--json file]\n";
+            return 2;
+        }
+    }
+
+    const auto inputs = bench::payloads(4096, 42);
+    std::ostringstream json;
+    json << "{\n  \"calls\": " << calls << ",\n  \"cases\": [";
+    fprintf(stderr, "%-18s %9s %8s %8s %8s %8s %9s %9s %10s %12s\n", "case", "calls", "mean ns", "p50", "p90", "p99",
+            "p999", "max", "allocs", "alloc bytes");
+
+    bool first = true;
+    for (auto& c : bench::cases()) {
+        if (!filter.empty() && std::string(c.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        auto run = c.setup();
+        const size_t count = std::max<size_t>(1, calls / c.calls_divisor);
+        // warm up the caches and the allocator
+        for (size_t i = 0; i < std::min<size_t>(count, inputs.size()); ++i) {
+            run(inputs[i]);
+        }
+
+        bench::Histogram latency;
+        uint64_t allocations = 0;
+        uint64_t max_allocations = 0;
+        uint64_t bytes = 0;
+        uint64_t tokens = 0;
+        hl::AllocationStats sources;
+        hl::AllocationTracker tracker(sources);
+        for (size_t i = 0; i < count; ++i) {
+            const std::string& input = inputs[i % inputs.size()];
+            const uint64_t allocations_before = bench::allocations.load(std::memory_order_relaxed);
+            const uint64_t bytes_before = bench::allocated_bytes.load(std::memory_order_relaxed);
+            const auto start = std::chrono::steady_clock::now();
+            tokens += run(input);
+            const auto end = std::chrono::steady_clock::now();
+            const uint64_t call_allocations = bench::allocations.load(std::memory_order_relaxed) - allocations_before;
+            bytes += bench::allocated_bytes.load(std::memory_order_relaxed) - bytes_before;
+            allocations += call_allocations;
+            max_allocations = std::max(max_allocations, call_allocations);
+            latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+        }
+
+        const double n = static_cast<double>(count);
+        fprintf(stderr, "%-18s %9zu %8.0f %8llu %8llu %8llu %9llu %9llu %10.1f %12.0f\n", c.name, count,
+                latency.mean(), static_cast<unsigned long long>(latency.percentile(0.5)),
+                static_cast<unsigned long long>(latency.percentile(0.9)),
+                static_cast<unsigned long long>(latency.percentile(0.99)),
+                static_cast<unsigned long long>(latency.percentile(0.999)),
+                static_cast<unsigned long long>(latency.max()), static_cast<double>(allocations) / n,
+                static_cast<double>(bytes) / n);
+
+        json << (first ? "" : ",") << "\n    {\n"
+             << "      \"name\": \"" << c.name << "\",\n"
+             << "      \"description\": \"" << c.description << "\",\n"
+             << "      \"calls\": " << count << ",\n"
+             << "      \"tokens_per_call\": " << static_cast<double>(tokens) / n << ",\n"
+             << "      \"latency_ns\": {\n"
+             << "        \"mean\": " << latency.mean() << ",\n"
+             << "        \"p50\": " << latency.percentile(0.5) << ",\n"
+             << "        \"p90\": " << latency.percentile(0.9) << ",\n"
+             << "        \"p99\": " << latency.percentile(0.99) << ",\n"
+             << "        \"p999\": " << latency.percentile(0.999) << ",\n"
+             << "        \"p9999\": " << latency.percentile(0.9999) << ",\n"
+             << "        \"max\": " << latency.max() << "\n"
+             << "      },\n"
+             << "      \"allocations_per_call\": " << static_cast<double>(allocations) / n << ",\n"
+             << "      \"max_allocations_per_call\": " << max_allocations << ",\n"
+             << "      \"allocated_bytes_per_call\": " << static_cast<double>(bytes) / n << ",\n"
+             << "      \"allocations_by_source\": {";
+        for (size_t i = 0; i < static_cast<size_t>(hl::AllocationSource::Count); ++i) {
+            json << (i == 0 ? "\n" : ",\n") << "        \""
+                 << hl::AllocationStats::name(static_cast<hl::AllocationSource>(i)) << "\": {\"allocations_per_call\": "
+                 << static_cast<double>(sources.count[i]) / n << ", \"bytes_per_call\": "
+                 << static_cast<double>(sources.bytes[i]) / n << "}";
+        }
+        json << "\n      }\n"
+             << "    }";
+        first = false;
+    }
+    json << "\n  ]\n}\n";
+
+    if (json_path.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(json_path) << json.str();
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Hardware performance counters (perf_event_open on Linux) around a piece of code
+//
+// Every counter is opened on its own for the calling thread (user space only), the ones the
+// machine or the permissions do not allow (see /proc/sys/kernel/perf_event_paranoid, virtual
+// machines, other systems) are reported as unavailable instead of failing.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAS_PERF_EVENT 1
+#endif
+
+namespace bench {
+
+class PerfCounters {
+public:
+    // the counters, in the order of values()
+    enum Counter { Cycles, Instructions, BranchMisses, L1DMisses, LLCMisses, Count };
+
+    static const char *name(int counter) {
+        static const char *const names[] = { "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses" };
+        return names[counter];
+    }
+
+    struct Values {
+        bool available[Count] = {};
+        double value[Count] = {}; // scaled when the counter was multiplexed
+    };
+
+private:
+    int m_fds[Count];
+
+#if defined(BENCH_HAS_PERF_EVENT)
+    static int open(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t cache_miss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+#endif
+
+public:
+    PerfCounters() {
+        for (int& fd : m_fds) {
+            fd = -1;
+        }
+#if defined(BENCH_HAS_PERF_EVENT)
+        m_fds[Cycles] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        m_fds[Instructions] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        m_fds[BranchMisses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        m_fds[L1DMisses] = open(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D));
+        m_fds[LLCMisses] = open(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL));
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+#if defined(BENCH_HAS_PERF_EVENT)
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    // returns true if at least one counter could be opened
+    bool any() const {
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // resets the counters and starts counting
+    void start() {
+#if defined(BENCH_HAS_PERF_EVENT)
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // stops counting and returns the counts since start()
+    Values stop() {
+        Values values;
+#if defined(BENCH_HAS_PERF_EVENT)
+        for (int i = 0; i < Count; ++i) {
+            if (m_fds[i] >= 0) {
+                ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        for (int i = 0; i < Count; ++i) {
+            uint64_t data[3]; // value, time enabled, time running
+            if (m_fds[i] < 0 || read(m_fds[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))
+                || data[2] == 0) {
+                continue;
+            }
+            values.available[i] = true;
+            values.value[i] = static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]);
+        }
+#endif
+        return values;
+    }
+};
+
+} // namespace bench
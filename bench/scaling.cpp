@@ -0,0 +1,166 @@
+// Throughput of hl::Tokenizer::tokenize over inputs of growing size and of several shapes
+//
+// Build: g++ -std=c++17 -O2 -pthread scaling.cpp -o scaling
+// Usage: ./scaling [--max-size MiB] [--seed N] [--filter substring] [--json file]
+//
+// Every series doubles the size of a generated input (see corpus.hpp) and reports the MB/s at each size.
+// A series is linear when the MB/s at the largest size is at least half of the MB/s at the smallest one.
+// The results are written as JSON to stdout (or to --json), and as a table to stderr.
+
+#include "corpus.hpp"
+#include "inputs.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+struct Grammar {
+    const char *name;
+    std::function<void(hl::Toks&)> setup;
+    size_t min_size;
+    size_t max_size;
+};
+
+struct Shape {
+    const char *name;
+    CorpusShape shape;
+};
+
+std::vector<Grammar> grammars() {
+    return {
+        { "js_keywords", [](hl::Toks& t) { add_js_grammar(t, false); }, 64 << 10, std::numeric_limits<size_t>::max() },
+        { "js_until_parser_match", [](hl::Toks& t) { add_js_grammar(t, false); t.set_default_as_until_parser_match(); },
+          64 << 10, std::numeric_limits<size_t>::max() },
+        // (std::regex is slow, its inputs start larger than 4 KiB only to be timed)
+        { "js_full_grammar", [](hl::Toks& t) { add_js_grammar(t, true); }, 16 << 10, std::numeric_limits<size_t>::max() },
+    };
+}
+
+std::vector<Shape> shapes() {
+    std::vector<Shape> out;
+    out.push_back({ "default", CorpusShape() });
+    {
+        CorpusShape s;
+        s.comment_weight = 4;
+        s.pair_content_words = 40;
+        out.push_back({ "comments", s });
+    }
+    {
+        CorpusShape s;
+        s.string_weight = 4;
+        out.push_back({ "strings", s });
+    }
+    {
+        CorpusShape s;
+        s.crlf_rate = 0.5;
+        out.push_back({ "crlf", s });
+    }
+    {
+        CorpusShape s;
+        s.line_length = 4000;
+        out.push_back({ "long_lines", s });
+    }
+    {
+        CorpusShape s;
+        s.unterminated_rate = 0.05;
+        out.push_back({ "unterminated", s });
+    }
+    {
+        CorpusShape s;
+        s.pathological_rate = 0.02;
+        out.push_back({ "pathological", s });
+    }
+    return out;
+}
+
+} // namespace bench
+
+int main(int argc, char **argv) {
+    size_t max_size = 8 << 20;
+    uint64_t seed = 1;
+    std::string filter;
+    std::string json_path;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--max-size" && i + 1 < argc) {
+            max_size = static_cast<size_t>(std::stod(argv[++i]) * (1 << 20));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--max-size MiB] [--seed N] [--filter substring] [--json file]\n";
+            return 2;
+        }
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"seed\": " << seed << ",\n  \"series\": [";
+    bool first = true;
+    for (auto& grammar : bench::grammars()) {
+        hl::Toks tokenizer;
+        grammar.setup(tokenizer);
+        for (auto& shape : bench::shapes()) {
+            const std::string name = std::string(grammar.name) + "/" + shape.name;
+            if (!filter.empty() && name.find(filter) == std::string::npos) {
+                continue;
+            }
+
+            std::vector<std::pair<size_t, double>> points; // bytes, MB/s
+            const size_t largest = std::min(max_size, grammar.max_size);
+            for (size_t size = grammar.min_size; size <= largest; size *= 2) {
+                // the same seed for every size, the smaller inputs are prefixes of the larger ones
+                bench::CorpusGenerator generator(tokenizer, shape.shape, seed);
+                const std::string input = generator.generate(size);
+                const auto start = std::chrono::steady_clock::now();
+                const size_t tokens = tokenizer.tokenize(input).size();
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                (void)tokens;
+                points.emplace_back(input.size(), static_cast<double>(input.size()) / 1e6 / seconds);
+            }
+            if (points.empty()) {
+                continue;
+            }
+
+            const double ratio = points.back().second / points.front().second;
+            const bool linear = ratio >= 0.5;
+            fprintf(stderr, "%-36s", name.c_str());
+            for (auto& point : points) {
+                fprintf(stderr, " %8.1f", point.second);
+            }
+            fprintf(stderr, "   MB/s %s\n", linear ? "linear" : "NOT LINEAR");
+
+            json << (first ? "" : ",") << "\n    {\n"
+                 << "      \"grammar\": \"" << grammar.name << "\",\n"
+                 << "      \"shape\": \"" << shape.name << "\",\n"
+                 << "      \"points\": [";
+            for (size_t i = 0; i < points.size(); ++i) {
+                json << (i == 0 ? "" : ", ") << "{\"bytes\": " << points[i].first << ", \"mb_per_s\": " << points[i].second
+                     << "}";
+            }
+            json << "],\n"
+                 << "      \"largest_to_smallest\": " << ratio << ",\n"
+                 << "      \"linear\": " << (linear ? "true" : "false") << "\n"
+                 << "    }";
+            first = false;
+        }
+    }
+    json << "\n  ]\n}\n";
+
+    if (json_path.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream(json_path) << json.str();
+    }
+    return 0;
+}